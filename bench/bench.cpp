@@ -0,0 +1,716 @@
+#include "datasets.h"
+#include "harness.h"
+#include "kd_tree/kd_tree.h"
+#include "kd_tree/page_resource.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Benchmark suite of tree building and queries.
+// Every combination of distribution, point count and dimension, and every loaded dataset file, is measured
+// and written as CSV or JSON, progress is logged to stderr. Run with --help for the options.
+
+struct Options
+{
+    std::vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+    std::vector<int> dims = { 2, 3, 8 };
+    std::vector<int> ks = { 1, 10, 100 };
+    std::vector<std::string> distributions{ std::begin(datasetGenerators), std::end(datasetGenerators) };
+    std::vector<std::string> files; // Datasets loaded from files, subsampled to the point counts
+
+    size_t queries = 1000;
+    int groupSize = 16; // Interleaved queries of batch queries, targets per packet and coherent group
+    BenchConfig config;
+
+    // Brute force queries are limited to roughly this many distance evaluations per benchmark
+    size_t bruteForceBudget = 100000000;
+
+    std::string filter; // Only benchmarks whose name contains the filter are run
+    BenchFormat format = BenchFormat::CSV;
+    std::string output; // Results go to stdout if empty
+    unsigned seed = 1;
+
+    // Nodes are allocated from a PageResource if set, the default resource otherwise
+    bool pageResource = false;
+    PageOptions pageOptions;
+};
+
+static const char* usage = R"(Usage: bench [options]
+  --n=1e3,1e4,1e5,1e6      Point counts
+  --dims=2,3,8             Dimensions, any of 2, 3, 4, 8, 16, 32, 64, 128
+  --k=1,10,100             Neighbor counts of the k-nearest neighbor benchmarks
+  --dist=uniform,...       Generated distributions: uniform, gaussian, clusters, manifold, duplicates, grid, sorted
+  --file=a.fvecs,b.ply     Datasets to load, .fvecs, .bvecs, .ply or .xyz
+  --queries=1000           Queries per repetition
+  --group=16               Interleaved queries of the batch benchmarks, targets per packet of the packet benchmarks
+  --reps=5                 Timed repetitions
+  --warmup=1               Untimed repetitions
+  --brute=1e8              Distance evaluations budget of brute force baselines, 0 disables them
+  --filter=name            Run only benchmarks whose name contains the filter
+  --format=csv|json        Output format
+  --out=path               Output file, stdout by default
+  --seed=1                 Random seed
+  --pages=none|thp|2mb|1gb Allocate nodes from mapped pages of the given size, default allocator if not given
+  --numa=interleave|N      NUMA placement of the mapped pages, interleaved or bound to node N
+)";
+
+// Picks query points from the dataset, slightly displaced so they rarely coincide with a point.
+// Coherent queries come in groups of groupSize scattered about one point spacing around the same point.
+Dataset SampleQueries(const Dataset& dataset, size_t count, std::mt19937& rng, int groupSize = 1)
+{
+    Dataset queries;
+    queries.dim = dataset.dim;
+    queries.coords.resize(count * dataset.dim);
+
+    float extent = 0;
+    for (int j = 0; j < dataset.dim; ++j)
+    {
+        float lo = std::numeric_limits<float>::max();
+        float hi = std::numeric_limits<float>::lowest();
+        for (size_t i = 0; i < dataset.Size(); ++i)
+        {
+            lo = std::min(lo, dataset[i][j]);
+            hi = std::max(hi, dataset[i][j]);
+        }
+        extent = std::max(extent, hi - lo);
+    }
+
+    float spacing = extent * (float)std::pow(double(dataset.Size()), -1.0 / dataset.dim);
+
+    std::uniform_int_distribution<size_t> pick{ 0, dataset.Size() - 1 };
+    std::normal_distribution<float> jitter{ 0, groupSize > 1 ? spacing : extent * 1e-4f };
+    const float* p = nullptr;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (i % groupSize == 0)
+        {
+            p = dataset[pick(rng)];
+        }
+
+        for (int j = 0; j < dataset.dim; ++j)
+        {
+            queries.coords[i * dataset.dim + j] = p[j] + jitter(rng);
+        }
+    }
+
+    return queries;
+}
+
+template <int K>
+std::vector<typename KDTree<K>::Point> ToPoints(const Dataset& dataset)
+{
+    std::vector<typename KDTree<K>::Point> points(dataset.Size());
+
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        std::copy_n(dataset[i], K, points[i].coord);
+        points[i].userData = nullptr;
+    }
+
+    return points;
+}
+
+template <int K>
+void Run(const Options& options,
+         const std::string& distribution,
+         const Dataset& dataset,
+         const Dataset& queries,
+         const Dataset& coherentQueries,
+         BenchReporter& reporter,
+         int& failures)
+{
+    using Tree = KDTree<K>;
+    using Point = typename Tree::Point;
+
+    size_t n = dataset.Size();
+    std::vector<Point> points = ToPoints<K>(dataset);
+    std::vector<Point> targets = ToPoints<K>(queries);
+    std::vector<Point> coherentTargets = ToPoints<K>(coherentQueries);
+
+    auto enabled = [&](const char* name) { return options.filter.empty() || std::strstr(name, options.filter.c_str()); };
+
+    auto report = [&](BenchResult result, const char* name, int k = 0, double radius = 0) {
+        result.name = name;
+        result.distribution = distribution;
+        result.n = n;
+        result.dim = K;
+        result.k = k;
+        result.radius = radius;
+        reporter.Add(result);
+
+        std::cerr << name << " " << distribution << " n=" << n << " dim=" << K;
+        if (k > 0)
+        {
+            std::cerr << " k=" << k;
+        }
+        std::cerr << ": p50 " << result.p50Ns << "ns, p99 " << result.p99Ns << "ns, " << result.queriesPerSecond << " ops/s"
+                  << std::endl;
+    };
+
+    // Huge trees are built only once
+    BenchConfig buildConfig = options.config;
+    if (n >= 10000000)
+    {
+        buildConfig = BenchConfig{ 0, 1 };
+    }
+
+    PageResource pages{ options.pageOptions };
+    std::pmr::memory_resource* resource = options.pageResource ? &pages : std::pmr::get_default_resource();
+
+    std::unique_ptr<Tree> tree;
+    if (enabled("build"))
+    {
+        report(Measure(buildConfig, 1,
+                       [&](size_t) {
+                           tree.reset();
+                           tree = std::make_unique<Tree>(points, resource);
+                           return tree->GetNodes().size();
+                       }),
+               "build");
+    }
+    else
+    {
+        tree = std::make_unique<Tree>(points, resource);
+    }
+
+    std::vector<float> nearest(targets.size());
+
+    if (enabled("nn"))
+    {
+        report(Measure(options.config, targets.size(), [&](size_t i) {
+                   auto result = tree->QueryNearestNeighbor(targets[i]);
+                   nearest[i] = result.distance2;
+                   return result.distance2;
+               }),
+               "nn");
+    }
+
+    for (int k : options.ks)
+    {
+        if (enabled("knn"))
+        {
+            typename Tree::KnnResultSet set{ k };
+            report(Measure(options.config, targets.size(), [&](size_t i) {
+                       tree->QueryKNearestNeighbors(targets[i], set);
+                       return set[set.Size() - 1].distance2;
+                   }),
+                   "knn", k);
+        }
+    }
+
+    // Tracking, every target moves by a tenth of the distance to its 10th neighbor and is queried again.
+    // Warm-started queries start from the results before the move, track_* query the moved targets from scratch.
+    if (enabled("track_") || enabled("warm_"))
+    {
+        int k10 = std::min<int>(10, (int)n);
+        int capacity = k10;
+        for (int k : options.ks)
+        {
+            capacity = std::max(capacity, std::min<int>(k, (int)n));
+        }
+
+        typename Tree::KnnResultSet set{ capacity };
+        std::vector<typename Tree::QueryResult> previous(targets.size() * set.Capacity());
+
+        std::vector<Point> moved = targets;
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            tree->QueryKNearestNeighbors(targets[i], set);
+            std::copy(set.Results().begin(), set.Results().end(), previous.begin() + i * set.Capacity());
+
+            float step = 0.1f * std::sqrt(set[k10 - 1].distance2 / K);
+            for (int j = 0; j < K; ++j)
+            {
+                moved[i][j] += step;
+            }
+        }
+
+        // k 0 is a nearest neighbor query
+        auto track = [&](const char* name, int k, bool warm) {
+            if (!enabled(name))
+            {
+                return;
+            }
+
+            if (k == 0)
+            {
+                report(Measure(options.config, moved.size(), [&](size_t i) {
+                           const auto* node = previous[i * set.Capacity()].node;
+                           auto result = warm ? tree->QueryNearestNeighbor(moved[i], node) : tree->QueryNearestNeighbor(moved[i]);
+                           return result.distance2;
+                       }),
+                       name);
+                return;
+            }
+
+            typename Tree::KnnResultSet result{ k };
+            report(Measure(options.config, moved.size(), [&](size_t i) {
+                       if (warm)
+                       {
+                           tree->QueryKNearestNeighbors(moved[i], result, std::span{ previous }.subspan(i * set.Capacity(), k));
+                       }
+                       else
+                       {
+                           tree->QueryKNearestNeighbors(moved[i], result);
+                       }
+                       return result[result.Size() - 1].distance2;
+                   }),
+                   name, k);
+        };
+
+        track("track_nn", 0, false);
+        track("warm_nn", 0, true);
+        for (int k : options.ks)
+        {
+            track("track_knn", std::min<int>(k, (int)n), false);
+            track("warm_knn", std::min<int>(k, (int)n), true);
+        }
+    }
+
+    // Batch queries are timed per chunk of targets, latencies are per query amortized over the chunk
+    const size_t chunk = 256;
+    auto amortize = [](BenchResult result, size_t per) {
+        for (double* latency : { &result.meanNs, &result.minNs, &result.p50Ns, &result.p90Ns, &result.p99Ns, &result.maxNs })
+        {
+            *latency /= per;
+        }
+        result.queries *= per;
+        result.queriesPerSecond *= per;
+
+        return result;
+    };
+
+    size_t chunks = targets.size() / chunk;
+    int maxK = 1;
+    for (int k : options.ks)
+    {
+        maxK = std::max(maxK, k);
+    }
+    std::vector<typename Tree::QueryResult> batchResults(chunk * maxK);
+
+    if (enabled("batch_nn") && chunks > 0)
+    {
+        report(amortize(Measure(options.config, chunks, [&](size_t i) {
+                   auto batch = std::span{ targets }.subspan(i * chunk, chunk);
+                   tree->QueryNearestNeighbors(batch, batchResults, options.groupSize);
+                   return batchResults[0].distance2;
+               }), chunk),
+               "batch_nn");
+    }
+
+    for (int k : options.ks)
+    {
+        if (enabled("batch_knn") && chunks > 0)
+        {
+            report(amortize(Measure(options.config, chunks, [&](size_t i) {
+                       auto batch = std::span{ targets }.subspan(i * chunk, chunk);
+                       tree->QueryKNearestNeighbors(batch, k, batchResults, options.groupSize);
+                       return batchResults[k - 1].distance2;
+                   }), chunk),
+                   "batch_knn", k);
+        }
+    }
+
+    // All targets as a single batch in every order, including the sorting
+    const std::pair<BatchOrder, const char*> orders[] = { { BatchOrder::Input, "input" },
+                                                          { BatchOrder::Morton, "morton" },
+                                                          { BatchOrder::Hilbert, "hilbert" } };
+    std::vector<typename Tree::QueryResult> orderedResults;
+
+    for (auto [order, orderName] : orders)
+    {
+        std::string name = std::string{ "ordered_nn_" } + orderName;
+        if (enabled(name.c_str()))
+        {
+            orderedResults.resize(targets.size());
+            report(amortize(Measure(options.config, 1,
+                                    [&](size_t) {
+                                        tree->QueryNearestNeighbors(targets, orderedResults, 0, order);
+                                        return orderedResults[0].distance2;
+                                    }),
+                            targets.size()),
+                   name.c_str());
+        }
+
+        name = std::string{ "ordered_knn_" } + orderName;
+        for (int k : options.ks)
+        {
+            if (enabled(name.c_str()))
+            {
+                orderedResults.resize(targets.size() * k);
+                report(amortize(Measure(options.config, 1,
+                                        [&](size_t) {
+                                            tree->QueryKNearestNeighbors(targets, k, orderedResults, 0, order);
+                                            return orderedResults[k - 1].distance2;
+                                        }),
+                                targets.size()),
+                       name.c_str(), k);
+            }
+        }
+    }
+
+    // Packets of coherent targets, compared to querying the same targets one by one
+    int packetSize = std::min(options.groupSize, Tree::maxPacketSize);
+
+    if (enabled("coherent_nn"))
+    {
+        report(Measure(options.config, coherentTargets.size(),
+                       [&](size_t i) { return tree->QueryNearestNeighbor(coherentTargets[i]).distance2; }),
+               "coherent_nn");
+    }
+
+    if (enabled("packet_nn") && chunks > 0)
+    {
+        report(amortize(Measure(options.config, chunks, [&](size_t i) {
+                   auto batch = std::span{ coherentTargets }.subspan(i * chunk, chunk);
+                   tree->QueryNearestNeighborsPacket(batch, batchResults, packetSize);
+                   return batchResults[0].distance2;
+               }), chunk),
+               "packet_nn");
+    }
+
+    for (int k : options.ks)
+    {
+        if (enabled("coherent_knn"))
+        {
+            typename Tree::KnnResultSet set{ k };
+            report(Measure(options.config, coherentTargets.size(), [&](size_t i) {
+                       tree->QueryKNearestNeighbors(coherentTargets[i], set);
+                       return set[set.Size() - 1].distance2;
+                   }),
+                   "coherent_knn", k);
+        }
+
+        if (enabled("packet_knn") && chunks > 0)
+        {
+            report(amortize(Measure(options.config, chunks, [&](size_t i) {
+                       auto batch = std::span{ coherentTargets }.subspan(i * chunk, chunk);
+                       tree->QueryKNearestNeighborsPacket(batch, k, batchResults, packetSize);
+                       return batchResults[k - 1].distance2;
+                   }), chunk),
+                   "packet_knn", k);
+        }
+    }
+
+    if (enabled("radius") || enabled("count_radius"))
+    {
+        // Radius around the median distance to the 10th neighbor, so that queries report about 10 points
+        int k = std::min<int>(10, (int)n);
+        typename Tree::KnnResultSet set{ k };
+
+        std::vector<float> distances;
+        for (const Point& target : targets)
+        {
+            tree->QueryKNearestNeighbors(target, set);
+            distances.push_back(set[k - 1].distance2);
+        }
+
+        std::nth_element(distances.begin(), distances.begin() + distances.size() / 2, distances.end());
+        float radius = std::sqrt(distances[distances.size() / 2]);
+
+        if (enabled("radius"))
+        {
+            std::vector<typename Tree::QueryResult> results;
+            report(Measure(options.config, targets.size(), [&](size_t i) {
+                       tree->QueryRadius(targets[i], radius, results);
+                       return results.size();
+                   }),
+                   "radius", 0, radius);
+        }
+
+        if (enabled("count_radius"))
+        {
+            report(Measure(options.config, targets.size(), [&](size_t i) { return tree->CountRadius(targets[i], radius); }),
+                   "count_radius", 0, radius);
+        }
+    }
+
+    // Brute force baseline on as many queries as the budget allows, which also checks the tree results
+    size_t bruteQueries = std::min(targets.size(), options.bruteForceBudget / std::max<size_t>(1, n));
+    if (enabled("brute_nn") && bruteQueries > 0)
+    {
+        std::vector<float> bruteNearest(bruteQueries);
+        report(Measure(options.config, bruteQueries, [&](size_t i) {
+                   float d = std::numeric_limits<float>::max();
+                   for (const Point& p : points)
+                   {
+                       d = std::min(d, Tree::dist2(targets[i], p));
+                   }
+                   bruteNearest[i] = d;
+                   return d;
+               }),
+               "brute_nn");
+
+        if (enabled("nn"))
+        {
+            for (size_t i = 0; i < bruteQueries; ++i)
+            {
+                if (nearest[i] != bruteNearest[i])
+                {
+                    std::cerr << "Mismatch of query " << i << ": tree " << nearest[i] << ", brute force " << bruteNearest[i]
+                              << std::endl;
+                    ++failures;
+                }
+            }
+        }
+    }
+}
+
+// Calls f with std::integral_constant<int, D> for the dimension, returns false for unsupported dimensions.
+template <int... Dims, typename F>
+bool DispatchDimension(int dim, F&& f)
+{
+    return ((dim == Dims ? (f(std::integral_constant<int, Dims>{}), true) : false) || ...);
+}
+
+template <typename T>
+std::vector<T> ParseList(const char* value)
+{
+    std::vector<T> list;
+
+    for (const char* p = value; *p != '\0';)
+    {
+        char* end;
+        double number = std::strtod(p, &end);
+        if (end == p)
+        {
+            break;
+        }
+
+        list.push_back(T(number));
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return list;
+}
+
+std::vector<std::string> ParseNames(const char* value)
+{
+    std::vector<std::string> names;
+
+    std::string token;
+    for (const char* p = value;; ++p)
+    {
+        if (*p == ',' || *p == '\0')
+        {
+            if (!token.empty())
+            {
+                names.push_back(token);
+            }
+            token.clear();
+
+            if (*p == '\0')
+            {
+                break;
+            }
+        }
+        else
+        {
+            token += *p;
+        }
+    }
+
+    return names;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* value = std::strchr(arg, '=');
+        value = value ? value + 1 : "";
+
+        auto is = [&](const char* name) { return std::strncmp(arg, name, std::strlen(name)) == 0; };
+
+        if (is("--n="))
+        {
+            options.sizes = ParseList<size_t>(value);
+        }
+        else if (is("--dims="))
+        {
+            options.dims = ParseList<int>(value);
+        }
+        else if (is("--k="))
+        {
+            options.ks = ParseList<int>(value);
+        }
+        else if (is("--dist="))
+        {
+            options.distributions = ParseNames(value);
+        }
+        else if (is("--file="))
+        {
+            options.files = ParseNames(value);
+        }
+        else if (is("--queries="))
+        {
+            options.queries = size_t(std::strtod(value, nullptr));
+        }
+        else if (is("--group="))
+        {
+            options.groupSize = std::atoi(value);
+            if (options.groupSize < 1)
+            {
+                std::cerr << "--group must be at least 1\n" << usage;
+                return 1;
+            }
+        }
+        else if (is("--reps="))
+        {
+            options.config.repetitions = std::atoi(value);
+        }
+        else if (is("--warmup="))
+        {
+            options.config.warmup = std::atoi(value);
+        }
+        else if (is("--brute="))
+        {
+            options.bruteForceBudget = size_t(std::strtod(value, nullptr));
+        }
+        else if (is("--filter="))
+        {
+            options.filter = value;
+        }
+        else if (is("--format="))
+        {
+            options.format = std::strcmp(value, "json") == 0 ? BenchFormat::JSON : BenchFormat::CSV;
+        }
+        else if (is("--out="))
+        {
+            options.output = value;
+        }
+        else if (is("--pages="))
+        {
+            options.pageResource = true;
+            options.pageOptions.hugePages = std::strcmp(value, "none") == 0  ? HugePages::None
+                                            : std::strcmp(value, "2mb") == 0 ? HugePages::Size2MB
+                                            : std::strcmp(value, "1gb") == 0 ? HugePages::Size1GB
+                                                                             : HugePages::Transparent;
+        }
+        else if (is("--numa="))
+        {
+            options.pageResource = true;
+            if (std::strcmp(value, "interleave") == 0)
+            {
+                options.pageOptions.numaPolicy = NumaPolicy::Interleave;
+            }
+            else
+            {
+                options.pageOptions.numaPolicy = NumaPolicy::Bind;
+                options.pageOptions.numaNode = std::atoi(value);
+            }
+        }
+        else if (is("--seed="))
+        {
+            options.seed = unsigned(std::atoi(value));
+        }
+        else
+        {
+            std::cerr << usage;
+            return std::strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    std::ofstream file;
+    if (!options.output.empty())
+    {
+        file.open(options.output);
+        if (!file)
+        {
+            std::cerr << "Cannot open " << options.output << std::endl;
+            return 1;
+        }
+    }
+
+    int failures = 0;
+    {
+        BenchReporter reporter{ options.format, options.output.empty() ? std::cout : file };
+
+        auto run = [&](const std::string& distribution, const Dataset& dataset, std::mt19937& rng) {
+            Dataset queries = SampleQueries(dataset, options.queries, rng);
+            Dataset coherentQueries = SampleQueries(dataset, options.queries, rng, options.groupSize);
+
+            bool supported = DispatchDimension<2, 3, 4, 8, 16, 32, 64, 128>(dataset.dim, [&](auto K) {
+                Run<decltype(K)::value>(options, distribution, dataset, queries, coherentQueries, reporter, failures);
+            });
+
+            if (!supported)
+            {
+                std::cerr << "Unsupported dimension " << dataset.dim << std::endl;
+            }
+            return supported;
+        };
+
+        for (const std::string& distribution : options.distributions)
+        {
+            for (size_t n : options.sizes)
+            {
+                for (int dim : options.dims)
+                {
+                    std::mt19937 rng{ options.seed };
+                    Dataset dataset = GenerateDataset(distribution, n, dim, rng);
+                    if (dataset.dim == 0)
+                    {
+                        std::cerr << "Unknown distribution " << distribution << std::endl;
+                        return 1;
+                    }
+
+                    if (n == 0 || !run(distribution, dataset, rng))
+                    {
+                        return 1;
+                    }
+                }
+            }
+        }
+
+        for (const std::string& path : options.files)
+        {
+            Dataset dataset;
+            std::string error;
+            if (!LoadDataset(path, dataset, error) || dataset.Size() == 0)
+            {
+                std::cerr << (error.empty() ? path + ": no points" : error) << std::endl;
+                return 1;
+            }
+
+            std::string name = path.substr(path.find_last_of("/\\") + 1);
+
+            // Point counts larger than the dataset run on the whole dataset, once
+            std::vector<size_t> counts;
+            for (size_t n : options.sizes)
+            {
+                counts.push_back(std::min(n, dataset.Size()));
+            }
+            std::sort(counts.begin(), counts.end());
+            counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+
+            for (size_t n : counts)
+            {
+                std::mt19937 rng{ options.seed };
+                if (!run(name, dataset.Sample(n, rng), rng))
+                {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    if (failures > 0)
+    {
+        std::cerr << failures << " tree results differ from brute force" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
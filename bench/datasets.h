@@ -0,0 +1,600 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Point sets stored as flat coordinates, one point every dim values
+struct Dataset
+{
+    size_t Size() const;
+    const float* operator[](size_t i) const;
+
+    // Returns count points picked at random without replacement, or all points if there are fewer.
+    Dataset Sample(size_t count, std::mt19937& rng) const;
+
+    int dim = 0;
+    std::vector<float> coords;
+};
+
+// Generators.
+// Coordinates are roughly within [-10000, 10000] like the points of the tests.
+//  uniform    Uniform in the cube
+//  gaussian   Single isotropic normal distribution
+//  clusters   Gaussian clusters of varying size and spread
+//  manifold   Points near a curve (dim 2) or a rolled up surface embedded in dim dimensions
+//  duplicates Every point is one of n / 100 distinct points
+//  grid       Regular lattice, many equal coordinates along every axis
+//  sorted     Uniform points ordered by their coordinates, the worst case for naive median selection
+static const char* const datasetGenerators[] = { "uniform", "gaussian", "clusters", "manifold", "duplicates", "grid", "sorted" };
+
+// Generates count points of the named distribution, returns an empty dataset for unknown names.
+Dataset GenerateDataset(const std::string& name, size_t count, int dim, std::mt19937& rng);
+
+// Loaders. They return false and set the error message if the file can't be read.
+// At most maxCount points are read.
+
+// Texmex vector files, every vector is a little-endian int32 dimension followed by float32 (fvecs) or uint8 (bvecs) values.
+bool LoadFvecs(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount = SIZE_MAX);
+bool LoadBvecs(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount = SIZE_MAX);
+
+// PLY point clouds in ascii or binary little-endian format, reads the x, y and z properties of the vertex element.
+bool LoadPly(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount = SIZE_MAX);
+
+// Text point clouds with whitespace separated x y z values per line, further values on a line are ignored.
+bool LoadXyz(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount = SIZE_MAX);
+
+// Picks the loader by file extension.
+bool LoadDataset(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount = SIZE_MAX);
+
+// Implementations
+
+inline size_t Dataset::Size() const
+{
+    return dim > 0 ? coords.size() / dim : 0;
+}
+
+inline const float* Dataset::operator[](size_t i) const
+{
+    return coords.data() + i * dim;
+}
+
+inline Dataset Dataset::Sample(size_t count, std::mt19937& rng) const
+{
+    if (count >= Size())
+    {
+        return *this;
+    }
+
+    std::vector<size_t> indices(Size());
+    std::iota(indices.begin(), indices.end(), 0);
+
+    // Partial Fisher-Yates shuffle
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::uniform_int_distribution<size_t> pick{ i, indices.size() - 1 };
+        std::swap(indices[i], indices[pick(rng)]);
+    }
+
+    Dataset sample;
+    sample.dim = dim;
+    sample.coords.reserve(count * dim);
+    for (size_t i = 0; i < count; ++i)
+    {
+        sample.coords.insert(sample.coords.end(), (*this)[indices[i]], (*this)[indices[i]] + dim);
+    }
+
+    return sample;
+}
+
+inline Dataset GenerateDataset(const std::string& name, size_t count, int dim, std::mt19937& rng)
+{
+    Dataset dataset;
+    dataset.dim = dim;
+    dataset.coords.resize(count * dim);
+
+    float* p = dataset.coords.data();
+    std::uniform_real_distribution<float> uniform{ -10000, 10000 };
+
+    if (name == "uniform")
+    {
+        for (float& c : dataset.coords)
+        {
+            c = uniform(rng);
+        }
+    }
+    else if (name == "gaussian")
+    {
+        std::normal_distribution<float> gaussian{ 0, 2500 };
+        for (float& c : dataset.coords)
+        {
+            c = gaussian(rng);
+        }
+    }
+    else if (name == "clusters")
+    {
+        const int clusterCount = 16;
+
+        std::vector<float> centers(clusterCount * dim);
+        std::vector<float> spreads(clusterCount);
+        std::vector<float> weights(clusterCount);
+        for (int i = 0; i < clusterCount; ++i)
+        {
+            for (int j = 0; j < dim; ++j)
+            {
+                centers[i * dim + j] = uniform(rng) * 0.8f;
+            }
+
+            // Spreads and sizes vary by orders of magnitude
+            spreads[i] = std::pow(10.0f, std::uniform_real_distribution<float>{ 1, 3 }(rng));
+            weights[i] = std::pow(10.0f, std::uniform_real_distribution<float>{ 0, 2 }(rng));
+        }
+
+        std::discrete_distribution<int> cluster{ weights.begin(), weights.end() };
+        std::normal_distribution<float> gaussian{ 0, 1 };
+        for (size_t i = 0; i < count; ++i, p += dim)
+        {
+            int c = cluster(rng);
+            for (int j = 0; j < dim; ++j)
+            {
+                p[j] = centers[c * dim + j] + spreads[c] * gaussian(rng);
+            }
+        }
+    }
+    else if (name == "manifold")
+    {
+        // Intrinsic coordinates mapped to a spiral (dim 2) or a swiss roll, embedded by a random linear map
+        const int features = dim == 2 ? 2 : 3;
+
+        std::normal_distribution<float> gaussian{ 0, 1 };
+        std::vector<float> embedding(features * dim);
+        for (float& e : embedding)
+        {
+            e = gaussian(rng) / std::sqrt(float(features));
+        }
+        if (dim <= features)
+        {
+            // Keep the shape as is in low dimensions
+            std::fill(embedding.begin(), embedding.end(), 0.0f);
+            for (int f = 0; f < features; ++f)
+            {
+                embedding[f * dim + f] = 1;
+            }
+        }
+
+        std::uniform_real_distribution<float> angle{ 1.5f * 3.14159265f, 4.5f * 3.14159265f };
+        std::uniform_real_distribution<float> height{ -1, 1 };
+        std::normal_distribution<float> noise{ 0, 10 };
+
+        float scale = 10000 / (4.5f * 3.14159265f);
+        for (size_t i = 0; i < count; ++i, p += dim)
+        {
+            float t = angle(rng);
+            float feature[3] = { t * std::cos(t) * scale, t * std::sin(t) * scale, height(rng) * 10000 };
+            if (features == 3)
+            {
+                std::swap(feature[1], feature[2]);
+            }
+
+            for (int j = 0; j < dim; ++j)
+            {
+                p[j] = noise(rng);
+                for (int f = 0; f < features; ++f)
+                {
+                    p[j] += embedding[f * dim + j] * feature[f];
+                }
+            }
+        }
+    }
+    else if (name == "duplicates")
+    {
+        size_t distinct = std::max<size_t>(1, count / 100);
+        Dataset unique = GenerateDataset("uniform", distinct, dim, rng);
+
+        std::uniform_int_distribution<size_t> pick{ 0, distinct - 1 };
+        for (size_t i = 0; i < count; ++i, p += dim)
+        {
+            std::copy_n(unique[pick(rng)], dim, p);
+        }
+    }
+    else if (name == "grid")
+    {
+        // Smallest lattice with at least count points, filled in order
+        size_t side = std::max<size_t>(2, (size_t)std::ceil(std::pow(double(count), 1.0 / dim)));
+        float spacing = 20000.0f / (side - 1);
+
+        for (size_t i = 0; i < count; ++i, p += dim)
+        {
+            size_t cell = i;
+            for (int j = 0; j < dim; ++j)
+            {
+                p[j] = -10000 + spacing * float(cell % side);
+                cell /= side;
+            }
+        }
+    }
+    else if (name == "sorted")
+    {
+        Dataset unsorted = GenerateDataset("uniform", count, dim, rng);
+
+        std::vector<size_t> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return std::lexicographical_compare(unsorted[a], unsorted[a] + dim, unsorted[b], unsorted[b] + dim);
+        });
+
+        for (size_t i = 0; i < count; ++i, p += dim)
+        {
+            std::copy_n(unsorted[order[i]], dim, p);
+        }
+    }
+    else
+    {
+        return Dataset{};
+    }
+
+    return dataset;
+}
+
+namespace datasets_detail
+{
+
+template <typename V>
+inline bool LoadVecs(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount)
+{
+    std::ifstream file{ path, std::ios::binary };
+    if (!file)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    dataset = Dataset{};
+
+    std::vector<V> values;
+    for (size_t i = 0; i < maxCount; ++i)
+    {
+        int32_t dim;
+        if (!file.read(reinterpret_cast<char*>(&dim), sizeof(dim)))
+        {
+            break;
+        }
+
+        if (dim <= 0 || (dataset.dim != 0 && dim != dataset.dim))
+        {
+            error = path + ": invalid dimension " + std::to_string(dim) + " of vector " + std::to_string(i);
+            return false;
+        }
+
+        dataset.dim = dim;
+        values.resize(dim);
+        if (!file.read(reinterpret_cast<char*>(values.data()), dim * sizeof(V)))
+        {
+            error = path + ": truncated vector " + std::to_string(i);
+            return false;
+        }
+
+        dataset.coords.insert(dataset.coords.end(), values.begin(), values.end());
+    }
+
+    if (dataset.Size() == 0)
+    {
+        error = path + ": no vectors";
+        return false;
+    }
+
+    return true;
+}
+
+inline int PlyTypeSize(const std::string& type)
+{
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8")
+    {
+        return 1;
+    }
+    if (type == "short" || type == "ushort" || type == "int16" || type == "uint16")
+    {
+        return 2;
+    }
+    if (type == "int" || type == "uint" || type == "float" || type == "int32" || type == "uint32" || type == "float32")
+    {
+        return 4;
+    }
+    if (type == "double" || type == "float64")
+    {
+        return 8;
+    }
+
+    return 0;
+}
+
+inline float PlyRead(const char* data, const std::string& type)
+{
+    auto read = [data]<typename V>(V) {
+        V v;
+        std::memcpy(&v, data, sizeof(V));
+        return float(v);
+    };
+
+    if (type == "char" || type == "int8")
+    {
+        return read(int8_t{});
+    }
+    if (type == "uchar" || type == "uint8")
+    {
+        return read(uint8_t{});
+    }
+    if (type == "short" || type == "int16")
+    {
+        return read(int16_t{});
+    }
+    if (type == "ushort" || type == "uint16")
+    {
+        return read(uint16_t{});
+    }
+    if (type == "int" || type == "int32")
+    {
+        return read(int32_t{});
+    }
+    if (type == "uint" || type == "uint32")
+    {
+        return read(uint32_t{});
+    }
+    if (type == "float" || type == "float32")
+    {
+        return read(float{});
+    }
+
+    return read(double{});
+}
+
+} // namespace datasets_detail
+
+inline bool LoadFvecs(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount)
+{
+    return datasets_detail::LoadVecs<float>(path, dataset, error, maxCount);
+}
+
+inline bool LoadBvecs(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount)
+{
+    return datasets_detail::LoadVecs<uint8_t>(path, dataset, error, maxCount);
+}
+
+inline bool LoadPly(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount)
+{
+    using namespace datasets_detail;
+
+    std::ifstream file{ path, std::ios::binary };
+    if (!file)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    std::string line;
+    if (!std::getline(file, line) || line.rfind("ply", 0) != 0)
+    {
+        error = path + ": not a PLY file";
+        return false;
+    }
+
+    // Header, only the vertex element is read so it has to come first
+    std::string format;
+    size_t vertexCount = 0;
+    bool vertexElement = false;
+    bool otherElement = false;
+
+    struct Property
+    {
+        std::string type;
+        std::string name;
+    };
+    std::vector<Property> properties;
+
+    while (std::getline(file, line))
+    {
+        std::istringstream words{ line };
+        std::string keyword;
+        words >> keyword;
+
+        if (keyword == "format")
+        {
+            words >> format;
+        }
+        else if (keyword == "element")
+        {
+            std::string name;
+            words >> name;
+
+            vertexElement = name == "vertex";
+            if (vertexElement)
+            {
+                if (otherElement)
+                {
+                    error = path + ": elements before the vertex element are not supported";
+                    return false;
+                }
+                words >> vertexCount;
+            }
+            else
+            {
+                otherElement = true;
+            }
+        }
+        else if (keyword == "property" && vertexElement)
+        {
+            Property property;
+            words >> property.type >> property.name;
+
+            if (property.type == "list")
+            {
+                error = path + ": list properties of vertices are not supported";
+                return false;
+            }
+
+            properties.push_back(property);
+        }
+        else if (keyword == "end_header")
+        {
+            break;
+        }
+    }
+
+    if (format != "ascii" && format != "binary_little_endian")
+    {
+        error = path + ": unsupported format " + format;
+        return false;
+    }
+
+    int axes[3] = { -1, -1, -1 };
+    for (int i = 0; i < (int)properties.size(); ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            if (properties[i].name == std::string(1, char('x' + j)))
+            {
+                axes[j] = i;
+            }
+        }
+    }
+
+    if (axes[0] == -1 || axes[1] == -1 || axes[2] == -1)
+    {
+        error = path + ": missing vertex coordinates";
+        return false;
+    }
+
+    size_t count = std::min(vertexCount, maxCount);
+
+    dataset = Dataset{};
+    dataset.dim = 3;
+    dataset.coords.reserve(count * 3);
+
+    std::vector<float> values(properties.size());
+
+    if (format == "ascii")
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            for (float& value : values)
+            {
+                if (!(file >> value))
+                {
+                    error = path + ": truncated vertex " + std::to_string(i);
+                    return false;
+                }
+            }
+
+            for (int axis : axes)
+            {
+                dataset.coords.push_back(values[axis]);
+            }
+        }
+    }
+    else
+    {
+        std::vector<int> offsets;
+        int stride = 0;
+        for (const Property& property : properties)
+        {
+            int size = PlyTypeSize(property.type);
+            if (size == 0)
+            {
+                error = path + ": unknown property type " + property.type;
+                return false;
+            }
+
+            offsets.push_back(stride);
+            stride += size;
+        }
+
+        std::vector<char> vertex(stride);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!file.read(vertex.data(), stride))
+            {
+                error = path + ": truncated vertex " + std::to_string(i);
+                return false;
+            }
+
+            for (int axis : axes)
+            {
+                dataset.coords.push_back(PlyRead(vertex.data() + offsets[axis], properties[axis].type));
+            }
+        }
+    }
+
+    return true;
+}
+
+inline bool LoadXyz(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount)
+{
+    std::ifstream file{ path };
+    if (!file)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    dataset = Dataset{};
+    dataset.dim = 3;
+
+    std::string line;
+    while (dataset.Size() < maxCount && std::getline(file, line))
+    {
+        // Skip blank lines and comments
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+        {
+            continue;
+        }
+
+        std::istringstream values{ line };
+        float p[3];
+        if (!(values >> p[0] >> p[1] >> p[2]))
+        {
+            error = path + ": invalid line " + line;
+            return false;
+        }
+
+        dataset.coords.insert(dataset.coords.end(), p, p + 3);
+    }
+
+    return true;
+}
+
+inline bool LoadDataset(const std::string& path, Dataset& dataset, std::string& error, size_t maxCount)
+{
+    auto endsWith = [&](const char* extension) {
+        size_t length = std::strlen(extension);
+        return path.size() >= length && path.compare(path.size() - length, length, extension) == 0;
+    };
+
+    if (endsWith(".fvecs"))
+    {
+        return LoadFvecs(path, dataset, error, maxCount);
+    }
+    if (endsWith(".bvecs"))
+    {
+        return LoadBvecs(path, dataset, error, maxCount);
+    }
+    if (endsWith(".ply"))
+    {
+        return LoadPly(path, dataset, error, maxCount);
+    }
+    if (endsWith(".xyz") || endsWith(".txt"))
+    {
+        return LoadXyz(path, dataset, error, maxCount);
+    }
+
+    error = path + ": unknown file extension";
+    return false;
+}
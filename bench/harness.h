@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct BenchConfig
+{
+    int warmup = 1;      // Untimed runs before measuring
+    int repetitions = 5; // Timed runs over all queries
+};
+
+// Parameters and latency summary of one benchmark
+struct BenchResult
+{
+    std::string name;
+    std::string distribution;
+    size_t n = 0;
+    int dim = 0;
+    int k = 0;
+    double radius = 0;
+
+    size_t queries = 0; // Operations per repetition
+    int repetitions = 0;
+
+    // Latency of a single operation in nanoseconds
+    double meanNs = 0;
+    double minNs = 0;
+    double p50Ns = 0;
+    double p90Ns = 0;
+    double p99Ns = 0;
+    double maxNs = 0;
+
+    double queriesPerSecond = 0;
+    double checksum = 0; // Sum of the values returned by the operations, keeps them from being optimized away
+};
+
+// Runs query(i) for i in [0, queries) repeatedly and records the latency of every call.
+// query returns a value convertible to double which is summed into the checksum.
+template <typename F>
+BenchResult Measure(const BenchConfig& config, size_t queries, F&& query)
+{
+    using clock = std::chrono::steady_clock;
+
+    BenchResult result;
+    result.queries = queries;
+    result.repetitions = config.repetitions;
+
+    for (int r = 0; r < config.warmup; ++r)
+    {
+        for (size_t i = 0; i < queries; ++i)
+        {
+            result.checksum += double(query(i));
+        }
+    }
+
+    std::vector<double> latencies;
+    latencies.reserve(queries * config.repetitions);
+
+    double total = 0;
+    for (int r = 0; r < config.repetitions; ++r)
+    {
+        result.checksum = 0;
+
+        auto begin = clock::now();
+        auto last = begin;
+        for (size_t i = 0; i < queries; ++i)
+        {
+            result.checksum += double(query(i));
+
+            auto now = clock::now();
+            latencies.push_back(std::chrono::duration<double, std::nano>(now - last).count());
+            last = now;
+        }
+
+        total += std::chrono::duration<double>(last - begin).count();
+    }
+
+    if (latencies.empty())
+    {
+        return result;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    // Nearest-rank percentile
+    auto percentile = [&](double p) { return latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))]; };
+
+    double sum = 0;
+    for (double latency : latencies)
+    {
+        sum += latency;
+    }
+
+    result.meanNs = sum / latencies.size();
+    result.minNs = latencies.front();
+    result.p50Ns = percentile(0.5);
+    result.p90Ns = percentile(0.9);
+    result.p99Ns = percentile(0.99);
+    result.maxNs = latencies.back();
+    result.queriesPerSecond = total > 0 ? latencies.size() / total : 0;
+
+    return result;
+}
+
+enum class BenchFormat
+{
+    CSV,
+    JSON,
+};
+
+// Writes benchmark results as CSV rows or a JSON array.
+class BenchReporter
+{
+public:
+    BenchReporter(BenchFormat format, std::ostream& out);
+    ~BenchReporter();
+
+    void Add(const BenchResult& result);
+
+private:
+    BenchFormat format;
+    std::ostream& out;
+    size_t count;
+};
+
+// Implementations
+
+inline BenchReporter::BenchReporter(BenchFormat format, std::ostream& out)
+    : format{ format }
+    , out{ out }
+    , count{ 0 }
+{
+    if (format == BenchFormat::CSV)
+    {
+        out << "name,distribution,n,dim,k,radius,queries,repetitions,mean_ns,min_ns,p50_ns,p90_ns,p99_ns,max_ns,"
+               "queries_per_second,checksum\n";
+    }
+    else
+    {
+        out << "[";
+    }
+}
+
+inline BenchReporter::~BenchReporter()
+{
+    if (format == BenchFormat::JSON)
+    {
+        out << "\n]\n";
+    }
+
+    out.flush();
+}
+
+inline void BenchReporter::Add(const BenchResult& r)
+{
+    char line[1024];
+
+    if (format == BenchFormat::CSV)
+    {
+        std::snprintf(line, sizeof(line), "%s,%s,%zu,%d,%d,%g,%zu,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.17g\n",
+                      r.name.c_str(), r.distribution.c_str(), r.n, r.dim, r.k, r.radius, r.queries, r.repetitions, r.meanNs,
+                      r.minNs, r.p50Ns, r.p90Ns, r.p99Ns, r.maxNs, r.queriesPerSecond, r.checksum);
+    }
+    else
+    {
+        std::snprintf(line, sizeof(line),
+                      "%s\n  {\"name\": \"%s\", \"distribution\": \"%s\", \"n\": %zu, \"dim\": %d, \"k\": %d, \"radius\": %g, "
+                      "\"queries\": %zu, \"repetitions\": %d, \"mean_ns\": %.1f, \"min_ns\": %.1f, \"p50_ns\": %.1f, "
+                      "\"p90_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f, \"queries_per_second\": %.1f, \"checksum\": %.17g}",
+                      count == 0 ? "" : ",", r.name.c_str(), r.distribution.c_str(), r.n, r.dim, r.k, r.radius, r.queries,
+                      r.repetitions, r.meanNs, r.minNs, r.p50Ns, r.p90Ns, r.p99Ns, r.maxNs, r.queriesPerSecond, r.checksum);
+    }
+
+    out << line;
+    out.flush();
+    ++count;
+}
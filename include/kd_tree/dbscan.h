@@ -0,0 +1,219 @@
+#pragma once
+
+#include "dual_tree.h"
+#include "union_find.h"
+
+#include <memory>
+
+// Labels every point with its DBSCAN cluster in [0, clusters), noise points are labeled -1.
+// A point is a core point if at least minPts points, including itself, are closer than eps.
+// Labels are indexed like the points the tree was built from. Work is split over threadCount threads.
+template <int K, typename T>
+std::vector<int> DBSCAN(const KDTree<K, T>& tree, std::type_identity_t<T> eps, int minPts, int threadCount = 0);
+
+// Returns the squared HDBSCAN core distance of every point,
+// the squared distance to its minPts-th nearest point counting the point itself.
+template <int K, typename T>
+std::vector<T> CoreDistances2(const KDTree<K, T>& tree, int minPts, int threadCount = 0);
+
+// Implementations
+
+template <int K, typename T>
+inline std::vector<int> DBSCAN(const KDTree<K, T>& tree, std::type_identity_t<T> eps, int minPts, int threadCount)
+{
+    using Node = typename KDTree<K, T>::Node;
+
+    auto nodes = tree.GetNodes();
+    int n = (int)nodes.size();
+    T eps2 = eps * eps;
+
+    std::vector<int> labels(n, -1);
+    if (n == 0)
+    {
+        return labels;
+    }
+
+    auto bounds = ComputeNodeBounds(tree);
+
+    // All points of a subtree whose bounding box diagonal is shorter than eps are within eps of each other.
+    // If there are at least minPts of them, they are core points of the same cluster without any query.
+    // Dense subtrees are identified by their root node, -1 for other nodes.
+    std::vector<int> dense(n, -1);
+    std::vector<int> denseRoots;
+
+    for (int i = 0; i < n;)
+    {
+        T diagonal2 = 0;
+        for (int j = 0; j < K; ++j)
+        {
+            T extent = bounds[i].max[j] - bounds[i].min[j];
+            diagonal2 += extent * extent;
+        }
+
+        if (nodes[i].count >= minPts && diagonal2 < eps2)
+        {
+            std::fill(dense.begin() + i, dense.begin() + i + nodes[i].count, i);
+            denseRoots.push_back(i);
+            i += nodes[i].count;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    // Core point test with early exit counting queries, indexed by node
+    std::unique_ptr<bool[]> core{ new bool[n] };
+
+    ParallelFor(n, threadCount, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i)
+        {
+            core[i] = dense[i] != -1 || tree.CountRadiusAtLeast(nodes[i].point, eps, minPts);
+        }
+    });
+
+    // Merge core points closer than eps
+    ConcurrentUnionFind clusters{ n };
+    auto index = [&](const Node* node) { return int(node - nodes.data()); };
+
+    ParallelFor(n, threadCount, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i)
+        {
+            if (!core[i])
+            {
+                continue;
+            }
+
+            if (dense[i] != -1)
+            {
+                // Dense regions are merged as a whole below
+                clusters.Union(i, dense[i]);
+                continue;
+            }
+
+            tree.QueryRadius(nodes[i].point, eps, [&](T, const Node* node) {
+                int j = index(node);
+                if (core[j])
+                {
+                    clusters.Union(i, j);
+                }
+            });
+        }
+    });
+
+    // Points of a dense region aren't queried one by one.
+    // A single query around the region center finds every point within eps of any of them.
+    ParallelFor((int)denseRoots.size(), threadCount, [&](int begin, int end, int) {
+        typename KDTree<K, T>::Point center;
+        for (int r = begin; r < end; ++r)
+        {
+            int root = denseRoots[r];
+            const NodeBounds<K, T>& b = bounds[root];
+
+            T halfDiagonal2 = 0;
+            for (int j = 0; j < K; ++j)
+            {
+                center[j] = (b.min[j] + b.max[j]) / 2;
+                halfDiagonal2 += (b.max[j] - center[j]) * (b.max[j] - center[j]);
+            }
+
+            T radius = eps + std::sqrt(halfDiagonal2);
+
+            tree.QueryRadius(center, radius, [&](T, const Node* node) {
+                int j = index(node);
+                if (!core[j] || clusters.Find(j) == clusters.Find(root))
+                {
+                    return;
+                }
+
+                // Connected if any point of the region is within eps
+                for (int i = root; i < root + nodes[root].count; ++i)
+                {
+                    if (KDTree<K, T>::dist2(nodes[i].point, node->point) < eps2)
+                    {
+                        clusters.Union(root, j);
+                        break;
+                    }
+                }
+            });
+        }
+    }, 1);
+
+    // Border points join the cluster of any core point within eps
+    std::vector<int> owner(n, -1);
+
+    ParallelFor(n, threadCount, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i)
+        {
+            if (core[i])
+            {
+                owner[i] = clusters.Find(i);
+                continue;
+            }
+
+            tree.QueryRadius(nodes[i].point, eps, [&](T, const Node* node) {
+                int j = index(node);
+                if (!core[j])
+                {
+                    return QueryControl::Continue;
+                }
+
+                owner[i] = clusters.Find(j);
+                return QueryControl::Stop;
+            });
+        }
+    });
+
+    // Number clusters consecutively in order of their first point
+    std::vector<int> ownerOf(n, -1);
+    for (int i = 0; i < n; ++i)
+    {
+        ownerOf[nodes[i].index] = owner[i];
+    }
+
+    std::vector<int> clusterLabel(n, -1);
+    int clusterCount = 0;
+
+    for (int i = 0; i < n; ++i)
+    {
+        int o = ownerOf[i];
+        if (o == -1)
+        {
+            continue;
+        }
+
+        if (clusterLabel[o] == -1)
+        {
+            clusterLabel[o] = clusterCount++;
+        }
+
+        labels[i] = clusterLabel[o];
+    }
+
+    return labels;
+}
+
+template <int K, typename T>
+inline std::vector<T> CoreDistances2(const KDTree<K, T>& tree, int minPts, int threadCount)
+{
+    int n = (int)tree.GetNodes().size();
+    std::vector<T> distances2(n, 0);
+
+    // The point itself is the first of its minPts nearest points
+    int k = minPts - 1;
+    if (k <= 0 || n == 0)
+    {
+        return distances2;
+    }
+
+    std::vector<int> indices(size_t(n) * k);
+    std::vector<T> neighbors2(size_t(n) * k);
+    tree.AllKNearestNeighbors(k, indices, neighbors2, threadCount);
+
+    for (int i = 0; i < n; ++i)
+    {
+        distances2[i] = neighbors2[size_t(i) * k + k - 1];
+    }
+
+    return distances2;
+}
@@ -0,0 +1,381 @@
+#pragma once
+
+#include "kd_tree.h"
+
+// Dual-tree algorithms.
+// Both trees are traversed together and pairs of subtrees are pruned by the distance between their bounding boxes,
+// which avoids restarting a single-tree query from the root for every point.
+
+// Tight axis-aligned bounding box of a subtree
+template <int K, typename T>
+struct NodeBounds
+{
+    T min[K];
+    T max[K];
+};
+
+// Computes the bounding box of every subtree, indexed like KDTree::GetNodes().
+template <int K, typename T>
+std::vector<NodeBounds<K, T>> ComputeNodeBounds(const KDTree<K, T>& tree);
+
+// Computes the K nearest neighbors in refTree of every point in queryTree.
+// Results of the i-th query point are written sorted ascending to [i * k, (i + 1) * k) of indices and distances2,
+// indices refer to the points refTree was built from. Missing neighbors are marked with index -1.
+template <int K, typename T>
+void KnnJoin(const KDTree<K, T>& queryTree,
+             const KDTree<K, T>& refTree,
+             int k,
+             std::span<int> indices,
+             std::span<std::type_identity_t<T>> distances2);
+
+// Calls callback(const Node* a, const Node* b, T distance2) for every pair of points from a and b closer than the radius.
+template <int K, typename T, typename F>
+void RangeJoin(const KDTree<K, T>& a, const KDTree<K, T>& b, std::type_identity_t<T> radius, F&& callback);
+
+// Implementations
+
+namespace dual_tree_detail
+{
+
+// A set of points of a tree, either the point of a node or the whole subtree rooted at it
+struct NodeSet
+{
+    int node;
+    bool subtree;
+};
+
+template <int K, typename T>
+inline T MinDist2(const T* min1, const T* max1, const T* min2, const T* max2)
+{
+    T d = 0;
+
+    for (int i = 0; i < K; ++i)
+    {
+        T gap = std::max(T(0), std::max(min1[i] - max2[i], min2[i] - max1[i]));
+        d += gap * gap;
+    }
+
+    return d;
+}
+
+template <int K, typename T>
+inline T MaxDist2(const T* min1, const T* max1, const T* min2, const T* max2)
+{
+    T d = 0;
+
+    for (int i = 0; i < K; ++i)
+    {
+        T span = std::max(max1[i] - min2[i], max2[i] - min1[i]);
+        d += span * span;
+    }
+
+    return d;
+}
+
+template <int K, typename T>
+struct TreeView
+{
+    using Node = typename KDTree<K, T>::Node;
+
+    TreeView(const KDTree<K, T>& tree)
+        : nodes{ tree.GetNodes() }
+        , bounds{ ComputeNodeBounds(tree) }
+    {
+    }
+
+    const T* Min(NodeSet s) const
+    {
+        return s.subtree ? bounds[s.node].min : nodes[s.node].point.coord;
+    }
+
+    const T* Max(NodeSet s) const
+    {
+        return s.subtree ? bounds[s.node].max : nodes[s.node].point.coord;
+    }
+
+    int Count(NodeSet s) const
+    {
+        return s.subtree ? nodes[s.node].count : 1;
+    }
+
+    int Index(const Node* node) const
+    {
+        return int(node - nodes.data());
+    }
+
+    std::span<const Node> nodes;
+    std::vector<NodeBounds<K, T>> bounds;
+};
+
+template <int K, typename T>
+struct KnnJoinState
+{
+    using Tree = KDTree<K, T>;
+
+    KnnJoinState(const Tree& queryTree, const Tree& refTree, int k)
+        : query{ queryTree }
+        , ref{ refTree }
+        , buffer(query.nodes.size() * k)
+        , subtreeBound(query.nodes.size(), std::numeric_limits<T>::max())
+    {
+        results.reserve(query.nodes.size());
+        for (size_t i = 0; i < query.nodes.size(); ++i)
+        {
+            results.emplace_back(std::span{ buffer }.subspan(i * k, k));
+        }
+    }
+
+    // Distance a reference point must be closer than to improve any result of the query set
+    T Bound(NodeSet q) const
+    {
+        return q.subtree ? subtreeBound[q.node] : results[q.node].Bound();
+    }
+
+    void Visit(NodeSet q, NodeSet r)
+    {
+        T d = MinDist2<K, T>(query.Min(q), query.Max(q), ref.Min(r), ref.Max(r));
+        if (d >= Bound(q))
+        {
+            return;
+        }
+
+        if (!q.subtree && !r.subtree)
+        {
+            // Both sets are single points, the box distance is the point distance
+            if (d < results[q.node].Bound())
+            {
+                results[q.node].Insert(d, &ref.nodes[r.node]);
+            }
+            return;
+        }
+
+        // Split the larger set
+        if (q.subtree && (!r.subtree || query.Count(q) >= ref.Count(r)))
+        {
+            const auto& node = query.nodes[q.node];
+
+            Visit(NodeSet{ q.node, false }, r);
+
+            T bound = results[q.node].Bound();
+            for (const auto* child : { node.left, node.right })
+            {
+                if (child != nullptr)
+                {
+                    int c = query.Index(child);
+                    Visit(NodeSet{ c, true }, r);
+                    bound = std::max(bound, subtreeBound[c]);
+                }
+            }
+
+            subtreeBound[q.node] = bound;
+        }
+        else
+        {
+            const auto& node = ref.nodes[r.node];
+
+            Visit(q, NodeSet{ r.node, false });
+
+            if (node.left == nullptr || node.right == nullptr)
+            {
+                for (const auto* child : { node.left, node.right })
+                {
+                    if (child != nullptr)
+                    {
+                        Visit(q, NodeSet{ ref.Index(child), true });
+                    }
+                }
+                return;
+            }
+
+            // Visit the closer child first to tighten the bound early
+            NodeSet left{ ref.Index(node.left), true };
+            NodeSet right{ ref.Index(node.right), true };
+            T dl = MinDist2<K, T>(query.Min(q), query.Max(q), ref.Min(left), ref.Max(left));
+            T dr = MinDist2<K, T>(query.Min(q), query.Max(q), ref.Min(right), ref.Max(right));
+
+            if (dr < dl)
+            {
+                std::swap(left, right);
+            }
+
+            Visit(q, left);
+            Visit(q, right);
+        }
+    }
+
+    TreeView<K, T> query;
+    TreeView<K, T> ref;
+
+    std::vector<typename Tree::QueryResult> buffer;
+    std::vector<typename Tree::KnnResultSet> results; // Indexed by query node
+    std::vector<T> subtreeBound;                      // Max bound of the results in each query subtree
+};
+
+template <int K, typename T, typename F>
+struct RangeJoinState
+{
+    RangeJoinState(const KDTree<K, T>& a, const KDTree<K, T>& b, T radius2, F& callback)
+        : a{ a }
+        , b{ b }
+        , radius2{ radius2 }
+        , callback{ callback }
+    {
+    }
+
+    void Visit(NodeSet p, NodeSet q)
+    {
+        if (MinDist2<K, T>(a.Min(p), a.Max(p), b.Min(q), b.Max(q)) >= radius2)
+        {
+            return;
+        }
+
+        // Every pair is within the radius, report them without further pruning
+        if (MaxDist2<K, T>(a.Min(p), a.Max(p), b.Min(q), b.Max(q)) < radius2)
+        {
+            for (int i = p.node; i < p.node + a.Count(p); ++i)
+            {
+                for (int j = q.node; j < q.node + b.Count(q); ++j)
+                {
+                    callback(&a.nodes[i], &b.nodes[j], KDTree<K, T>::dist2(a.nodes[i].point, b.nodes[j].point));
+                }
+            }
+            return;
+        }
+
+        if (!p.subtree && !q.subtree)
+        {
+            T d = KDTree<K, T>::dist2(a.nodes[p.node].point, b.nodes[q.node].point);
+            if (d < radius2)
+            {
+                callback(&a.nodes[p.node], &b.nodes[q.node], d);
+            }
+            return;
+        }
+
+        // Split the larger set
+        if (p.subtree && (!q.subtree || a.Count(p) >= b.Count(q)))
+        {
+            const auto& node = a.nodes[p.node];
+
+            Visit(NodeSet{ p.node, false }, q);
+            for (const auto* child : { node.left, node.right })
+            {
+                if (child != nullptr)
+                {
+                    Visit(NodeSet{ a.Index(child), true }, q);
+                }
+            }
+        }
+        else
+        {
+            const auto& node = b.nodes[q.node];
+
+            Visit(p, NodeSet{ q.node, false });
+            for (const auto* child : { node.left, node.right })
+            {
+                if (child != nullptr)
+                {
+                    Visit(p, NodeSet{ b.Index(child), true });
+                }
+            }
+        }
+    }
+
+    TreeView<K, T> a;
+    TreeView<K, T> b;
+    T radius2;
+    F& callback;
+};
+
+} // namespace dual_tree_detail
+
+template <int K, typename T>
+inline std::vector<NodeBounds<K, T>> ComputeNodeBounds(const KDTree<K, T>& tree)
+{
+    auto nodes = tree.GetNodes();
+    std::vector<NodeBounds<K, T>> bounds(nodes.size());
+
+    // Children come after their parent in pre-order, so a reverse pass visits them first
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+        const auto& node = nodes[i];
+        NodeBounds<K, T>& b = bounds[i];
+
+        for (int j = 0; j < K; ++j)
+        {
+            b.min[j] = node.point[j];
+            b.max[j] = node.point[j];
+        }
+
+        for (const auto* child : { node.left, node.right })
+        {
+            if (child == nullptr)
+            {
+                continue;
+            }
+
+            const NodeBounds<K, T>& c = bounds[child - nodes.data()];
+            for (int j = 0; j < K; ++j)
+            {
+                b.min[j] = std::min(b.min[j], c.min[j]);
+                b.max[j] = std::max(b.max[j], c.max[j]);
+            }
+        }
+    }
+
+    return bounds;
+}
+
+template <int K, typename T>
+inline void KnnJoin(const KDTree<K, T>& queryTree,
+                    const KDTree<K, T>& refTree,
+                    int k,
+                    std::span<int> indices,
+                    std::span<std::type_identity_t<T>> distances2)
+{
+    using namespace dual_tree_detail;
+
+    auto queryNodes = queryTree.GetNodes();
+    assert(indices.size() >= queryNodes.size() * k);
+    assert(distances2.size() >= queryNodes.size() * k);
+
+    if (queryNodes.empty())
+    {
+        return;
+    }
+
+    KnnJoinState<K, T> state{ queryTree, refTree, k };
+    if (!refTree.GetNodes().empty())
+    {
+        state.Visit(NodeSet{ 0, true }, NodeSet{ 0, true });
+    }
+
+    for (size_t i = 0; i < queryNodes.size(); ++i)
+    {
+        auto& result = state.results[i];
+        result.Sort();
+
+        int* rowIndices = indices.data() + size_t(queryNodes[i].index) * k;
+        T* rowDistances = distances2.data() + size_t(queryNodes[i].index) * k;
+        for (int j = 0; j < k; ++j)
+        {
+            bool found = j < result.Size();
+            rowIndices[j] = found ? result[j].node->index : -1;
+            rowDistances[j] = found ? result[j].distance2 : std::numeric_limits<T>::max();
+        }
+    }
+}
+
+template <int K, typename T, typename F>
+inline void RangeJoin(const KDTree<K, T>& a, const KDTree<K, T>& b, std::type_identity_t<T> radius, F&& callback)
+{
+    using namespace dual_tree_detail;
+
+    if (a.GetNodes().empty() || b.GetNodes().empty())
+    {
+        return;
+    }
+
+    RangeJoinState<K, T, std::remove_reference_t<F>> state{ a, b, radius * radius, callback };
+    state.Visit(NodeSet{ 0, true }, NodeSet{ 0, true });
+}
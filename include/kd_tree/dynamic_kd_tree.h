@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+// KD tree whose dimension is given at runtime.
+// Points are copied into a flat coordinate buffer (one point every dim values) in tree order.
+// Queries are dispatched to kernels compiled for common dimensions so the distance loop can be unrolled.
+template <typename T = float>
+class DynamicKDTree
+{
+public:
+    struct Node
+    {
+        Node(int index);
+
+        const T* point; // Coordinates of the point, dim values
+        int index;      // Index of the point in the original buffer
+        Node* left;
+        Node* right;
+    };
+
+    struct QueryResult
+    {
+        QueryResult(T distance2, const Node* node);
+        bool operator<(const QueryResult& rhs) const;
+
+        T distance2; // Squared distance
+        const Node* node;
+    };
+
+    // Build KD tree from given flat coordinate buffer.
+    // The i-th point starts at coords[i * stride], stride defaults to dim.
+    DynamicKDTree(int dim, std::span<const T> coords, size_t stride = 0);
+
+    // Build KD tree from given flat coordinate buffer.
+    // If a tree already exists, the original tree will be deleted.
+    void BuildTree(int dim, std::span<const T> coords, size_t stride = 0);
+
+    // Delete internal KD tree.
+    void DeleteTree();
+
+    // Compute squared distance between two points of the tree dimension.
+    T dist2(const T* p1, const T* p2) const;
+
+    // Query functions. Target must point to dim values.
+
+    // Returns the nearest neighbor data.
+    QueryResult QueryNearestNeighbor(const T* target) const;
+
+    // Returns the max-heap of K nearest neighbors results.
+    std::vector<QueryResult> QueryKNearestNeighbors(const T* target, int k) const;
+
+    // Callback object should implement the QueryRadiusCallback(T distance2, const Node* node) function.
+    template <typename F>
+    void QueryRadius(const T* target, T radius, F* callback) const;
+
+    // Returns the dimension of the tree.
+    int GetDimension() const;
+
+    // Returns the internal tree object.
+    const Node* GetRootNode() const;
+
+private:
+    // Calls f with std::integral_constant<int, D>, where D is the tree dimension for specialized kernels and 0 otherwise.
+    template <typename F>
+    decltype(auto) Dispatch(F&& f) const;
+
+    template <int D>
+    T Dist2(const T* p1, const T* p2) const;
+
+    Node* BuildTree(std::span<const T> coords, size_t stride, int* indices, int count, int depth);
+
+    template <int D>
+    void QueryNearestNeighbor(const Node* node, const T* target, const Node** nearest, T* minDist, int depth) const;
+    template <int D>
+    void QueryKNearestNeighbors(const Node* node, const T* target, int k, std::vector<QueryResult>& pq, int depth) const;
+    template <int D, typename F>
+    void QueryRadius(const Node* node, const T* target, T radius2, F* callback, int depth) const;
+
+    int dim;
+    Node* root;
+    std::vector<Node> nodes;
+    std::vector<T> coords;
+};
+
+// Implementations
+
+template <typename T>
+inline DynamicKDTree<T>::Node::Node(int index)
+    : point{ nullptr }
+    , index{ index }
+    , left{ nullptr }
+    , right{ nullptr }
+{
+}
+
+template <typename T>
+inline DynamicKDTree<T>::QueryResult::QueryResult(T distance2, const Node* node)
+    : distance2{ distance2 }
+    , node{ node }
+{
+}
+
+template <typename T>
+inline bool DynamicKDTree<T>::QueryResult::operator<(const QueryResult& rhs) const
+{
+    return distance2 < rhs.distance2;
+}
+
+template <typename T>
+inline DynamicKDTree<T>::DynamicKDTree(int dim, std::span<const T> coords, size_t stride)
+    : dim{ dim }
+    , root{ nullptr }
+{
+    BuildTree(dim, coords, stride);
+}
+
+template <typename T>
+inline void DynamicKDTree<T>::BuildTree(int newDim, std::span<const T> points, size_t stride)
+{
+    assert(newDim > 0);
+
+    if (root != nullptr)
+    {
+        DeleteTree();
+    }
+
+    dim = newDim;
+    if (stride == 0)
+    {
+        stride = dim;
+    }
+    assert(stride >= size_t(dim));
+
+    // The last point doesn't need the padding of a full stride
+    size_t count = points.size() < size_t(dim) ? 0 : (points.size() - dim) / stride + 1;
+
+    // Every point becomes exactly one node
+    nodes.reserve(count);
+
+    std::vector<int> indices(count);
+    std::iota(indices.begin(), indices.end(), 0);
+
+    root = BuildTree(points, stride, indices.data(), (int)count, 0);
+
+    // Copy coordinates in tree order so that nearby nodes share cache lines
+    coords.resize(count * dim);
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        T* dst = coords.data() + i * dim;
+        std::copy_n(points.data() + nodes[i].index * stride, dim, dst);
+        nodes[i].point = dst;
+    }
+}
+
+template <typename T>
+inline void DynamicKDTree<T>::DeleteTree()
+{
+    nodes.clear();
+    coords.clear();
+    root = nullptr;
+}
+
+template <typename T>
+inline T DynamicKDTree<T>::dist2(const T* p1, const T* p2) const
+{
+    return Dispatch([&](auto kernel) { return Dist2<decltype(kernel)::value>(p1, p2); });
+}
+
+template <typename T>
+inline typename DynamicKDTree<T>::QueryResult DynamicKDTree<T>::QueryNearestNeighbor(const T* target) const
+{
+    assert(root != nullptr);
+
+    const Node* nn = nullptr;
+    T d = std::numeric_limits<T>::max();
+    Dispatch([&](auto kernel) { QueryNearestNeighbor<decltype(kernel)::value>(root, target, &nn, &d, 0); });
+
+    return QueryResult{ d, nn };
+}
+
+template <typename T>
+inline std::vector<typename DynamicKDTree<T>::QueryResult> DynamicKDTree<T>::QueryKNearestNeighbors(const T* target, int k) const
+{
+    assert(root != nullptr);
+
+    // Priority queue
+    std::vector<QueryResult> pq;
+    pq.reserve(k + 1);
+
+    Dispatch([&](auto kernel) { QueryKNearestNeighbors<decltype(kernel)::value>(root, target, k, pq, 0); });
+
+    return pq;
+}
+
+template <typename T>
+template <typename F>
+inline void DynamicKDTree<T>::QueryRadius(const T* target, T radius, F* callback) const
+{
+    assert(root != nullptr);
+
+    Dispatch([&](auto kernel) { QueryRadius<decltype(kernel)::value>(root, target, radius * radius, callback, 0); });
+}
+
+template <typename T>
+inline int DynamicKDTree<T>::GetDimension() const
+{
+    return dim;
+}
+
+template <typename T>
+inline const typename DynamicKDTree<T>::Node* DynamicKDTree<T>::GetRootNode() const
+{
+    return root;
+}
+
+template <typename T>
+template <typename F>
+inline decltype(auto) DynamicKDTree<T>::Dispatch(F&& f) const
+{
+    switch (dim)
+    {
+    case 2:
+        return f(std::integral_constant<int, 2>{});
+    case 3:
+        return f(std::integral_constant<int, 3>{});
+    case 4:
+        return f(std::integral_constant<int, 4>{});
+    case 8:
+        return f(std::integral_constant<int, 8>{});
+    case 16:
+        return f(std::integral_constant<int, 16>{});
+    case 32:
+        return f(std::integral_constant<int, 32>{});
+    case 64:
+        return f(std::integral_constant<int, 64>{});
+    case 128:
+        return f(std::integral_constant<int, 128>{});
+    default:
+        return f(std::integral_constant<int, 0>{});
+    }
+}
+
+template <typename T>
+template <int D>
+inline T DynamicKDTree<T>::Dist2(const T* p1, const T* p2) const
+{
+    // D is a compile time constant for the specialized kernels
+    const int n = D > 0 ? D : dim;
+
+    T d = 0;
+
+    for (int i = 0; i < n; ++i)
+    {
+        d += (p1[i] - p2[i]) * (p1[i] - p2[i]);
+    }
+
+    return d;
+}
+
+template <typename T>
+inline typename DynamicKDTree<T>::Node* DynamicKDTree<T>::BuildTree(
+    std::span<const T> points, size_t stride, int* indices, int count, int depth)
+{
+    if (count <= 0)
+    {
+        return nullptr;
+    }
+
+    int axis = depth % dim;
+    int mid = count / 2;
+
+    std::nth_element(indices, indices + mid, indices + count,
+                     [&](int left, int right) { return points[left * stride + axis] < points[right * stride + axis]; });
+
+    // Children point into nodes, which must not reallocate
+    assert(nodes.size() < nodes.capacity());
+
+    // Create kd tree node
+    Node& node = nodes.emplace_back(indices[mid]);
+
+    // Build left and right sub trees recursively
+    node.left = BuildTree(points, stride, indices, mid, depth + 1);
+    node.right = BuildTree(points, stride, indices + mid + 1, count - mid - 1, depth + 1);
+
+    return &node;
+}
+
+template <typename T>
+template <int D>
+inline void DynamicKDTree<T>::QueryNearestNeighbor(
+    const Node* node, const T* target, const Node** nearest, T* minDist, int depth) const
+{
+    if (node == nullptr)
+    {
+        return;
+    }
+
+    T d = Dist2<D>(target, node->point);
+    if (d < *minDist)
+    {
+        *minDist = d;
+        *nearest = node;
+    }
+
+    const Node* next;
+    const Node* other;
+
+    // Compare axis for current depth and find next branch to descend
+    int axis = depth % (D > 0 ? D : dim);
+    if (target[axis] < node->point[axis])
+    {
+        next = node->left;
+        other = node->right;
+    }
+    else
+    {
+        next = node->right;
+        other = node->left;
+    }
+
+    QueryNearestNeighbor<D>(next, target, nearest, minDist, depth + 1);
+
+    T border = target[axis] - node->point[axis];
+    if (*minDist > border * border)
+    {
+        QueryNearestNeighbor<D>(other, target, nearest, minDist, depth + 1);
+    }
+}
+
+template <typename T>
+template <int D>
+inline void DynamicKDTree<T>::QueryKNearestNeighbors(
+    const Node* node, const T* target, int k, std::vector<QueryResult>& pq, int depth) const
+{
+    if (node == nullptr)
+    {
+        return;
+    }
+
+    const size_t size = size_t(k);
+
+    T d = Dist2<D>(target, node->point);
+    if (pq.size() < size || d < pq.front().distance2)
+    {
+        pq.emplace_back(d, node);
+        std::push_heap(pq.begin(), pq.end());
+
+        if (pq.size() > size)
+        {
+            std::pop_heap(pq.begin(), pq.end());
+            pq.pop_back();
+        }
+    }
+
+    const Node* next;
+    const Node* other;
+
+    int axis = depth % (D > 0 ? D : dim);
+    if (target[axis] < node->point[axis])
+    {
+        next = node->left;
+        other = node->right;
+    }
+    else
+    {
+        next = node->right;
+        other = node->left;
+    }
+
+    QueryKNearestNeighbors<D>(next, target, k, pq, depth + 1);
+
+    T border = target[axis] - node->point[axis];
+    if (pq.size() < size || border * border < pq.front().distance2)
+    {
+        QueryKNearestNeighbors<D>(other, target, k, pq, depth + 1);
+    }
+}
+
+template <typename T>
+template <int D, typename F>
+inline void DynamicKDTree<T>::QueryRadius(const Node* node, const T* target, T radius2, F* callback, int depth) const
+{
+    if (node == nullptr)
+    {
+        return;
+    }
+
+    T d = Dist2<D>(target, node->point);
+    if (d < radius2)
+    {
+        callback->QueryRadiusCallback(d, node);
+    }
+
+    const Node* next;
+    const Node* other;
+
+    int axis = depth % (D > 0 ? D : dim);
+    if (target[axis] < node->point[axis])
+    {
+        next = node->left;
+        other = node->right;
+    }
+    else
+    {
+        next = node->right;
+        other = node->left;
+    }
+
+    QueryRadius<D>(next, target, radius2, callback, depth + 1);
+
+    T border = target[axis] - node->point[axis];
+    if (radius2 > border * border)
+    {
+        QueryRadius<D>(other, target, radius2, callback, depth + 1);
+    }
+}
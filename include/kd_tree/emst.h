@@ -0,0 +1,255 @@
+#pragma once
+
+#include "dual_tree.h"
+#include "union_find.h"
+
+// Edge between two points, given by the indices of the points the tree was built from
+template <typename T>
+struct EmstEdge
+{
+    int a;
+    int b;
+    T distance2; // Squared length
+};
+
+// Computes the Euclidean minimum spanning tree of the points in the tree with dual-tree Boruvka.
+// Returns the n - 1 edges sorted by ascending length.
+template <int K, typename T>
+std::vector<EmstEdge<T>> ComputeEMST(const KDTree<K, T>& tree);
+
+// Single-linkage clustering from the minimum spanning tree edges.
+// Points connected by edges shorter than maxDistance share a cluster. Returns the cluster label in [0, clusters) of every point.
+template <typename T>
+std::vector<int> SingleLinkageClusters(std::span<const EmstEdge<T>> edges, int pointCount, std::type_identity_t<T> maxDistance);
+
+// Implementations
+
+namespace emst_detail
+{
+
+using dual_tree_detail::MinDist2;
+using dual_tree_detail::NodeSet;
+
+template <int K, typename T>
+struct BoruvkaState
+{
+    BoruvkaState(const KDTree<K, T>& tree)
+        : view{ tree }
+        , components((int)view.nodes.size())
+        , component(view.nodes.size())
+        , subtreeComponent(view.nodes.size())
+        , neighborDist(view.nodes.size())
+        , neighbor(view.nodes.size())
+        , subtreeBound(view.nodes.size())
+    {
+    }
+
+    // Runs one Boruvka round, adding the shortest edge leaving every component.
+    void Round(std::vector<EmstEdge<T>>& edges)
+    {
+        int n = (int)view.nodes.size();
+
+        for (int i = 0; i < n; ++i)
+        {
+            component[i] = components.Find(i);
+        }
+
+        // A subtree is labeled with its component if all of its points belong to it, -1 otherwise
+        for (int i = n; i-- > 0;)
+        {
+            const auto& node = view.nodes[i];
+            int label = component[i];
+
+            for (const auto* child : { node.left, node.right })
+            {
+                if (child != nullptr && subtreeComponent[view.Index(child)] != label)
+                {
+                    label = -1;
+                }
+            }
+
+            subtreeComponent[i] = label;
+        }
+
+        std::fill(neighborDist.begin(), neighborDist.end(), std::numeric_limits<T>::max());
+        std::fill(subtreeBound.begin(), subtreeBound.end(), std::numeric_limits<T>::max());
+
+        Visit(NodeSet{ 0, true }, NodeSet{ 0, true });
+
+        for (int i = 0; i < n; ++i)
+        {
+            if (component[i] != i || neighborDist[i] == std::numeric_limits<T>::max())
+            {
+                continue;
+            }
+
+            auto [a, b] = neighbor[i];
+            if (components.Union(a, b))
+            {
+                edges.push_back(EmstEdge<T>{ view.nodes[a].index, view.nodes[b].index, neighborDist[i] });
+            }
+        }
+    }
+
+    int Label(NodeSet s) const
+    {
+        return s.subtree ? subtreeComponent[s.node] : component[s.node];
+    }
+
+    // Distance a point must be closer than to improve the candidate edge of any component in the set
+    T Bound(NodeSet q) const
+    {
+        return q.subtree ? subtreeBound[q.node] : neighborDist[component[q.node]];
+    }
+
+    void Visit(NodeSet q, NodeSet r)
+    {
+        // Pairs within a single component can't contribute an edge
+        int label = Label(q);
+        if (label != -1 && label == Label(r))
+        {
+            return;
+        }
+
+        T d = MinDist2<K, T>(view.Min(q), view.Max(q), view.Min(r), view.Max(r));
+        if (d >= Bound(q))
+        {
+            return;
+        }
+
+        if (!q.subtree && !r.subtree)
+        {
+            int c = component[q.node];
+            if (d < neighborDist[c])
+            {
+                neighborDist[c] = d;
+                neighbor[c] = { q.node, r.node };
+            }
+            return;
+        }
+
+        // Split the larger set
+        if (q.subtree && (!r.subtree || view.Count(q) >= view.Count(r)))
+        {
+            const auto& node = view.nodes[q.node];
+
+            Visit(NodeSet{ q.node, false }, r);
+
+            T bound = neighborDist[component[q.node]];
+            for (const auto* child : { node.left, node.right })
+            {
+                if (child != nullptr)
+                {
+                    int c = view.Index(child);
+                    Visit(NodeSet{ c, true }, r);
+                    bound = std::max(bound, subtreeBound[c]);
+                }
+            }
+
+            subtreeBound[q.node] = bound;
+        }
+        else
+        {
+            const auto& node = view.nodes[r.node];
+
+            Visit(q, NodeSet{ r.node, false });
+
+            NodeSet children[2];
+            int childCount = 0;
+            for (const auto* child : { node.left, node.right })
+            {
+                if (child != nullptr)
+                {
+                    children[childCount++] = NodeSet{ view.Index(child), true };
+                }
+            }
+
+            // Visit the closer child first to tighten the bound early
+            if (childCount == 2 && MinDist2<K, T>(view.Min(q), view.Max(q), view.Min(children[1]), view.Max(children[1])) <
+                                       MinDist2<K, T>(view.Min(q), view.Max(q), view.Min(children[0]), view.Max(children[0])))
+            {
+                std::swap(children[0], children[1]);
+            }
+
+            for (int i = 0; i < childCount; ++i)
+            {
+                Visit(q, children[i]);
+            }
+        }
+    }
+
+    dual_tree_detail::TreeView<K, T> view;
+
+    // Components over node indices
+    UnionFind components;
+    std::vector<int> component;        // Component of every node at the start of the round
+    std::vector<int> subtreeComponent; // Component of every subtree, -1 if mixed
+
+    // Candidate edge of every component, indexed by the component representative
+    std::vector<T> neighborDist;
+    std::vector<std::pair<int, int>> neighbor;
+
+    std::vector<T> subtreeBound; // Max candidate distance of the components in each subtree
+};
+
+} // namespace emst_detail
+
+template <int K, typename T>
+inline std::vector<EmstEdge<T>> ComputeEMST(const KDTree<K, T>& tree)
+{
+    int n = (int)tree.GetNodes().size();
+
+    std::vector<EmstEdge<T>> edges;
+    if (n < 2)
+    {
+        return edges;
+    }
+
+    edges.reserve(n - 1);
+
+    emst_detail::BoruvkaState<K, T> state{ tree };
+
+    // Every round at least halves the number of components
+    while (state.components.GetSetCount() > 1)
+    {
+        state.Round(edges);
+    }
+
+    std::sort(edges.begin(), edges.end(),
+              [](const EmstEdge<T>& e1, const EmstEdge<T>& e2) { return e1.distance2 < e2.distance2; });
+
+    return edges;
+}
+
+template <typename T>
+inline std::vector<int> SingleLinkageClusters(
+    std::span<const EmstEdge<T>> edges, int pointCount, std::type_identity_t<T> maxDistance)
+{
+    UnionFind clusters{ pointCount };
+
+    for (const EmstEdge<T>& e : edges)
+    {
+        if (e.distance2 < maxDistance * maxDistance)
+        {
+            clusters.Union(e.a, e.b);
+        }
+    }
+
+    // Number the clusters consecutively in order of their first point
+    std::vector<int> labels(pointCount, -1);
+    std::vector<int> rootLabel(pointCount, -1);
+    int clusterCount = 0;
+
+    for (int i = 0; i < pointCount; ++i)
+    {
+        int root = clusters.Find(i);
+        if (rootLabel[root] == -1)
+        {
+            rootLabel[root] = clusterCount++;
+        }
+
+        labels[i] = rootLabel[root];
+    }
+
+    return labels;
+}
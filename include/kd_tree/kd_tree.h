@@ -1,19 +1,295 @@
 #pragma once
 
 #include <algorithm>
+#include <bit>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory_resource>
 #include <numeric>
 #include <span>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-// Compute complete binary tree size
-inline size_t compute_size(size_t n)
+// Splits [0, count) into contiguous ranges and calls work(begin, end, thread) for each of them on its own thread.
+// threadCount 0 uses all hardware threads. Ranges are at least minRange long.
+template <typename F>
+inline void ParallelFor(int count, int threadCount, F&& work, int minRange = 1024)
+{
+    if (threadCount <= 0)
+    {
+        threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    threadCount = std::max(1, std::min(threadCount, count / std::max(1, minRange)));
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < threadCount; ++t)
+    {
+        threads.emplace_back(work, int(size_t(count) * t / threadCount), int(size_t(count) * (t + 1) / threadCount), t);
+    }
+
+    work(0, int(size_t(count) / threadCount), 0);
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// Sorts the items by key with a stable least significant digit radix sort on threadCount threads.
+// threadCount 0 uses all hardware threads. Bytes in which all keys are equal are skipped.
+template <typename V>
+inline void RadixSort(std::vector<std::pair<uint64_t, V>>& items, int threadCount = 0)
+{
+    const int minRange = 1 << 16;
+
+    int count = (int)items.size();
+    if (threadCount <= 0)
+    {
+        threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    threadCount = std::max(1, std::min(threadCount, count / minRange));
+
+    uint64_t all = ~uint64_t(0);
+    uint64_t any = 0;
+    for (const auto& item : items)
+    {
+        all &= item.first;
+        any |= item.first;
+    }
+
+    std::vector<std::pair<uint64_t, V>> buffer(items.size());
+    std::vector<size_t> offsets(size_t(threadCount) * 256);
+
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        if (((all ^ any) >> shift & 0xff) == 0)
+        {
+            continue;
+        }
+
+        // Digit histogram of every range, turned into the position of its first item of each digit
+        std::fill(offsets.begin(), offsets.end(), 0);
+        ParallelFor(
+            count, threadCount,
+            [&](int begin, int end, int thread) {
+                for (int i = begin; i < end; ++i)
+                {
+                    ++offsets[thread * 256 + (items[i].first >> shift & 0xff)];
+                }
+            },
+            minRange);
+
+        size_t position = 0;
+        for (int digit = 0; digit < 256; ++digit)
+        {
+            for (int thread = 0; thread < threadCount; ++thread)
+            {
+                size_t n = offsets[thread * 256 + digit];
+                offsets[thread * 256 + digit] = position;
+                position += n;
+            }
+        }
+
+        ParallelFor(
+            count, threadCount,
+            [&](int begin, int end, int thread) {
+                size_t* offset = &offsets[thread * 256];
+                for (int i = begin; i < end; ++i)
+                {
+                    buffer[offset[items[i].first >> shift & 0xff]++] = std::move(items[i]);
+                }
+            },
+            minRange);
+
+        items.swap(buffer);
+    }
+}
+
+// Index of a cell along the Z-order curve, interleaving the bits of its coordinates.
+// Coordinates are in [0, 2^bits), dimensions * bits is at most 64.
+inline uint64_t MortonCode(const uint32_t* coords, int dimensions, int bits)
+{
+    assert(dimensions * bits <= 64);
+
+    uint64_t code = 0;
+    for (int bit = bits - 1; bit >= 0; --bit)
+    {
+        for (int i = 0; i < dimensions; ++i)
+        {
+            code = code << 1 | (coords[i] >> bit & 1);
+        }
+    }
+
+    return code;
+}
+
+// Index of a cell along the Hilbert curve, consecutive cells are adjacent. Modifies coords.
+// Coordinates are in [0, 2^bits), dimensions * bits is at most 64.
+inline uint64_t HilbertCode(uint32_t* coords, int dimensions, int bits)
+{
+    assert(dimensions * bits <= 64);
+
+    // Transposes the coordinates to the Hilbert index bits, see J. Skilling, Programming the Hilbert curve
+    uint32_t m = uint32_t(1) << (bits - 1);
+
+    for (uint32_t q = m; q > 1; q >>= 1)
+    {
+        uint32_t p = q - 1;
+        for (int i = 0; i < dimensions; ++i)
+        {
+            if (coords[i] & q)
+            {
+                coords[0] ^= p;
+            }
+            else
+            {
+                uint32_t t = (coords[0] ^ coords[i]) & p;
+                coords[0] ^= t;
+                coords[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    for (int i = 1; i < dimensions; ++i)
+    {
+        coords[i] ^= coords[i - 1];
+    }
+
+    uint32_t t = 0;
+    for (uint32_t q = m; q > 1; q >>= 1)
+    {
+        if (coords[dimensions - 1] & q)
+        {
+            t ^= q - 1;
+        }
+    }
+
+    for (int i = 0; i < dimensions; ++i)
+    {
+        coords[i] ^= t;
+    }
+
+    return MortonCode(coords, dimensions, bits);
+}
+
+// Order in which batch queries visit their targets
+enum class BatchOrder
+{
+    Input,   // As given
+    Morton,  // Along the Z-order curve through the bounding box of the tree
+    Hilbert, // Along the Hilbert curve, more local than the Z-order curve but slower to compute
+};
+
+// Return value of radius query callbacks to steer the traversal
+enum class QueryControl
+{
+    Continue, // Keep reporting points within the radius
+    Stop,     // Terminate the query
+    Shrink,   // Shrink the radius to the distance of the reported point
+};
+
+// Per-query traversal statistics, compiled in by defining KD_TREE_STATS to 1 before including this header.
+// The definition must be the same in every translation unit. When disabled, nothing is counted.
+#ifndef KD_TREE_STATS
+#define KD_TREE_STATS 0
+#endif
+
+#if KD_TREE_STATS
+#define KD_TREE_STAT(expr) (expr)
+#else
+#define KD_TREE_STAT(expr) ((void)0)
+#endif
+
+// Software prefetching of child nodes during nearest neighbor traversals, disabled by defining KD_TREE_PREFETCH to 0.
+#ifndef KD_TREE_PREFETCH
+#define KD_TREE_PREFETCH 1
+#endif
+
+#if KD_TREE_PREFETCH && (defined(__GNUC__) || defined(__clang__))
+#define KD_TREE_PREFETCH_ADDRESS(p) __builtin_prefetch(p)
+#elif KD_TREE_PREFETCH && defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define KD_TREE_PREFETCH_ADDRESS(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define KD_TREE_PREFETCH_ADDRESS(p) ((void)(p))
+#endif
+
+struct QueryStats
+{
+    // Adds the counters of rhs, e.g. to aggregate queries or threads
+    QueryStats& operator+=(const QueryStats& rhs);
+
+    uint64_t queries = 0;
+    uint64_t nodesVisited = 0;
+    uint64_t leavesScanned = 0;       // Visited nodes without children
+    uint64_t distanceEvaluations = 0; // Point distances computed
+    uint64_t branchesPruned = 0;      // Subtrees skipped by the distance or box test
+    uint64_t backtracks = 0;          // Subtrees descended after the nearer one
+    int maxStackDepth = 0;            // Deepest recursion level reached
+};
+
+// Returns the stats of the last query run on the calling thread.
+inline QueryStats& GetQueryStats()
+{
+    static thread_local QueryStats stats;
+    return stats;
+}
+
+inline QueryStats& QueryStats::operator+=(const QueryStats& rhs)
+{
+    queries += rhs.queries;
+    nodesVisited += rhs.nodesVisited;
+    leavesScanned += rhs.leavesScanned;
+    distanceEvaluations += rhs.distanceEvaluations;
+    branchesPruned += rhs.branchesPruned;
+    backtracks += rhs.backtracks;
+    maxStackDepth = std::max(maxStackDepth, rhs.maxStackDepth);
+
+    return *this;
+}
+
+namespace kd_tree_stats
+{
+
+inline void BeginQuery()
+{
+    GetQueryStats() = QueryStats{};
+    GetQueryStats().queries = 1;
+}
+
+template <typename Node>
+inline void Visit(const Node* node, int depth)
+{
+    QueryStats& stats = GetQueryStats();
+
+    ++stats.nodesVisited;
+    stats.leavesScanned += node->left == nullptr && node->right == nullptr;
+    stats.maxStackDepth = std::max(stats.maxStackDepth, depth + 1);
+}
+
+// Records whether a non-empty subtree beyond the nearer one was descended or pruned
+template <typename Node>
+inline void Branch(const Node* node, bool descended)
 {
-    size_t exp = static_cast<size_t>(log2(n - 1)) + 2;
-    return static_cast<size_t>(pow(2, exp));
+    if (node != nullptr)
+    {
+        ++(descended ? GetQueryStats().backtracks : GetQueryStats().branchesPruned);
+    }
 }
 
+} // namespace kd_tree_stats
+
+// Queries are const and don't modify the tree, so a built tree can be queried from multiple threads concurrently.
+// Building or deleting the tree must not overlap with queries.
 template <int K, typename T = float>
 class KDTree
 {
@@ -29,15 +305,18 @@ public:
 
     struct Node
     {
-        Node(const Point& p);
+        Node(const Point& p, int index);
 
         Point point;
         Node* left;
         Node* right;
+        int count; // Number of points in the subtree rooted at this node
+        int index; // Index of the point in the points the tree was built from
     };
 
     struct QueryResult
     {
+        QueryResult() = default;
         QueryResult(T distance2, const Node* node);
         bool operator<(const QueryResult& rhs) const;
 
@@ -45,11 +324,58 @@ public:
         const Node* node;
     };
 
+    // Fixed capacity result set of K nearest neighbors queries, reusable across queries without allocation.
+    // Small sets are kept as an insertion-sorted array, larger ones as a max-heap which is sorted at the end of a query.
+    class KnnResultSet
+    {
+    public:
+        static constexpr int maxSortedSize = 32;
+
+        // Result set owning storage for k results.
+        KnnResultSet(int k);
+
+        // Result set writing into caller storage, k is the size of the buffer.
+        KnnResultSet(std::span<QueryResult> buffer);
+
+        KnnResultSet(const KnnResultSet&) = delete;
+        KnnResultSet& operator=(const KnnResultSet&) = delete;
+        KnnResultSet(KnnResultSet&&) = default;
+        KnnResultSet& operator=(KnnResultSet&&) = default;
+
+        void Clear();
+
+        // Squared distance a point must be closer than to enter the set.
+        T Bound() const;
+
+        // Inserts a result closer than Bound(), evicting the farthest result if the set is full.
+        void Insert(T distance2, const Node* node);
+
+        // Sorts the results by ascending distance.
+        void Sort();
+
+        int Capacity() const;
+        int Size() const;
+        bool Full() const;
+
+        // Returns the results, sorted ascending after a query.
+        std::span<const QueryResult> Results() const;
+        const QueryResult& operator[](int idx) const;
+
+    private:
+        friend class KDTree;
+
+        std::vector<QueryResult> storage;
+        std::span<QueryResult> results;
+        int size;
+        T limit; // Bound until the set is full
+    };
+
     // Compute squared distance between two points.
     static T dist2(const Point& p1, const Point& p2);
 
     // Build KD tree from given points.
-    KDTree(const std::span<Point>& points);
+    // Nodes are allocated from the memory resource, which has to outlive the tree.
+    KDTree(const std::span<Point>& points, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
     ~KDTree();
 
     // Build KD tree from given points.
@@ -62,32 +388,298 @@ public:
     // Query functions.
 
     // Returns the nearest neighbor data.
-    QueryResult QueryNearestNeighbor(const Point& target);
+    QueryResult QueryNearestNeighbor(const Point& target) const;
 
     // Returns the max-heap of K nearest neighbors results.
-    std::vector<QueryResult> QueryKNearestNeighbors(const Point& target, int k);
+    std::vector<QueryResult> QueryKNearestNeighbors(const Point& target, int k) const;
+
+    // Fills the result set with the K nearest neighbors sorted ascending, k is the capacity of the set.
+    void QueryKNearestNeighbors(const Point& target, KnnResultSet& result) const;
+
+    // Writes the K nearest neighbors sorted ascending into the buffer, k is the size of the buffer.
+    // Returns the number of written results.
+    int QueryKNearestNeighbors(const Point& target, std::span<QueryResult> out) const;
+
+    // Batch queries.
+    // groupSize queries are traversed interleaved, each query visits one node before switching to the next one
+    // and prefetches the node it visits next, so that the cache misses of the queries overlap.
+    // Results of the i-th target are written to results[i] or sorted ascending to [i * k, (i + 1) * k),
+    // missing neighbors have a null node.
+    // Targets in random order can be sorted along a space filling curve first, so that consecutive queries visit
+    // nearby nodes. Results are still written in the order of the targets.
+    // Sorted targets mostly hit the cache, so there is little latency left for interleaving to hide.
+    // groupSize 0 interleaves 16 queries of targets in input order and runs sorted ones one after another.
+
+    void QueryNearestNeighbors(std::span<const Point> targets,
+                               std::span<QueryResult> results,
+                               int groupSize = 0,
+                               BatchOrder order = BatchOrder::Input) const;
+    void QueryKNearestNeighbors(std::span<const Point> targets,
+                                int k,
+                                std::span<QueryResult> results,
+                                int groupSize = 0,
+                                BatchOrder order = BatchOrder::Input) const;
+
+    // Packet queries for spatially coherent targets, e.g. neighboring pixels or particles.
+    // packetSize consecutive targets descend the tree together and share every node fetch. Distances and split planes
+    // are computed for all targets of the packet at once, it only diverges where its targets fall on different sides.
+    // Results are written and targets can be ordered like the ones of batch queries. packetSize is at most maxPacketSize.
+
+    static constexpr int maxPacketSize = 64;
+
+    void QueryNearestNeighborsPacket(std::span<const Point> targets,
+                                     std::span<QueryResult> results,
+                                     int packetSize = 16,
+                                     BatchOrder order = BatchOrder::Input) const;
+    void QueryKNearestNeighborsPacket(std::span<const Point> targets,
+                                      int k,
+                                      std::span<QueryResult> results,
+                                      int packetSize = 16,
+                                      BatchOrder order = BatchOrder::Input) const;
+
+    // Warm-started queries for targets that moved slightly since their previous query, e.g. in tracking loops.
+    // The distances to the previous neighbors bound the search from the first node on, so that the traversal
+    // prunes every subtree off the path to the target. previous holds distinct nodes like the results of the previous
+    // query and may be the results of the same set. Results are the same as the ones of a query from scratch.
+
+    QueryResult QueryNearestNeighbor(const Point& target, const Node* previous) const;
+    void QueryKNearestNeighbors(const Point& target, KnnResultSet& result, std::span<const QueryResult> previous) const;
+
+    // Filtered queries.
+    // Only points for which predicate(const Node* node) returns true are considered.
+    // The nearest neighbor result has a null node if no point passes the predicate.
+
+    template <typename P>
+        requires std::predicate<P&, const Node*>
+    QueryResult QueryNearestNeighbor(const Point& target, P&& predicate) const;
+
+    template <typename P>
+        requires std::predicate<P&, const Node*>
+    void QueryKNearestNeighbors(const Point& target, KnnResultSet& result, P&& predicate) const;
+
+    // Stores the category bitmask category(const Point& p) of every point and the union of the masks of every subtree.
+    // Queries given categories skip points and whole subtrees sharing none of them.
+    // Masks are deleted with the tree and have to be built again after rebuilding it.
+    template <typename F>
+    void BuildCategoryMasks(F&& category);
+
+    // Filtered queries considering only points with a category in categories that pass the predicate.
+    // Requires BuildCategoryMasks.
+
+    template <typename P>
+        requires std::predicate<P&, const Node*>
+    QueryResult QueryNearestNeighbor(const Point& target, uint64_t categories, P&& predicate) const;
+
+    template <typename P>
+        requires std::predicate<P&, const Node*>
+    void QueryKNearestNeighbors(const Point& target, KnnResultSet& result, uint64_t categories, P&& predicate) const;
 
     // Callback object should implement the QueryRadiusCallback(T distance2, const Node* node) function.
+    // The function may return void or a QueryControl value.
+    template <typename F>
+        requires requires(F* f, T d, const Node* n) { f->QueryRadiusCallback(d, n); }
+    void QueryRadius(const Point& target, T radius, F* callback) const;
+
+    // Callable is invoked as callback(T distance2, const Node* node) and may return void or a QueryControl value.
     template <typename F>
-    void QueryRadius(const Point& target, T radius, F* callback);
+        requires std::invocable<F&, T, const Node*>
+    void QueryRadius(const Point& target, T radius, F&& callback) const;
+
+    // Stores the results within the radius in out, reusing its capacity. Results are sorted by distance if requested.
+    // If there are more than maxResults points, only the maxResults nearest ones are kept.
+    void QueryRadius(const Point& target,
+                     T radius,
+                     std::vector<QueryResult>& out,
+                     bool sorted = false,
+                     size_t maxResults = std::numeric_limits<size_t>::max()) const;
+
+    // Writes the node of every point inside the axis-aligned box [min, max] to the output iterator.
+    // Returns the output iterator past the last written node.
+    template <typename OutputIt>
+    OutputIt QueryBox(const Point& min, const Point& max, OutputIt out) const;
+
+    // Counting functions.
+    // Subtrees whose cell is entirely inside the query range are counted without visiting their points.
+
+    // Returns the number of points within the radius.
+    int CountRadius(const Point& target, T radius) const;
+
+    // Returns the number of points inside the axis-aligned box [min, max].
+    int CountBox(const Point& min, const Point& max) const;
+
+    // Returns true if there are at least n points within the radius. Stops as soon as n points are found.
+    bool CountRadiusAtLeast(const Point& target, T radius, int n) const;
+
+    // Returns true if there are at least n points inside the box [min, max]. Stops as soon as n points are found.
+    bool CountBoxAtLeast(const Point& min, const Point& max, int n) const;
+
+    // Computes the K nearest neighbors of every point in the tree, excluding the point itself.
+    // Results of the i-th point are written sorted ascending to [i * k, (i + 1) * k) of indices and distances2.
+    // Missing neighbors are marked with index -1. Points are split over threadCount threads, 0 uses all hardware threads.
+    void AllKNearestNeighbors(int k, std::span<int> indices, std::span<T> distances2, int threadCount = 0) const;
+
+    // Neighbor lists in compressed sparse row format.
+    // Neighbors of the i-th point are indices[offsets[i], offsets[i + 1]).
+    struct NeighborList
+    {
+        std::vector<int> offsets;
+        std::vector<int> indices;
+    };
+
+    // Finds every pair of points closer than the radius and stores the neighbors of each point in out, reusing its capacity.
+    // If unique is true, a pair (i, j) is only stored in the list of i, where i < j. The order within a list is unspecified.
+    void AllPairsWithinRadius(T radius, NeighborList& out, bool unique = false, int threadCount = 0) const;
+
+    // Shape, memory and build time of the tree
+    struct TreeStats
+    {
+        size_t nodeCount = 0;
+        size_t leafCount = 0;                   // Nodes without children, every node holds a single point
+        int height = 0;                         // Number of levels
+        std::vector<size_t> depthHistogram;     // Number of nodes at each depth
+        std::vector<size_t> leafDepthHistogram; // Number of leaves at each depth
+
+        // Bytes of node storage
+        size_t memoryUsed = 0;
+        size_t memoryReserved = 0;
+
+        // Mean ratio of the longest to the shortest side of the node cells, cells with an empty side are skipped
+        double averageAspectRatio = 0;
+
+        // Build time breakdown in seconds
+        double buildSeconds = 0;
+        double allocateSeconds = 0;  // Node storage and point indices
+        double partitionSeconds = 0; // Median selection and node creation
+        double boundsSeconds = 0;    // Bounding box of the points
+    };
+
+    // Returns statistics of the built tree. Traverses the whole tree.
+    TreeStats GetStats() const;
 
     // Returns the internal tree object.
     const Node* GetRootNode() const;
 
+    // Returns the nodes in pre-order, the subtree of a node is the range [node, node + node->count).
+    std::span<const Node> GetNodes() const;
+
 private:
     Node* BuildTree(const std::span<Point>& points, int* indices, int count, int depth);
 
-    void QueryNearestNeighbor(Node* root, const Point& target, Node** nearest, T* minDist, int depth);
-    void QueryKNearestNeighbors(Node* root, const Point& target, int k, std::vector<QueryResult>& pq, int depth);
+    void QueryNearestNeighbor(const Node* node, const Point& target, const Node** nearest, T* minDist, int depth) const;
+    void QueryKNearestNeighbors(const Node* node, const Point& target, int k, std::vector<QueryResult>& pq, int depth) const;
+    template <typename Filter, typename SubtreeFilter>
+    void QueryKNearestNeighbors(const Node* node,
+                                const Point& target,
+                                KnnResultSet& result,
+                                Filter& filter,
+                                SubtreeFilter& subtreeFilter,
+                                int depth) const;
+    // Filter of unfiltered queries, accepting every node
+    static constexpr auto acceptAll = [](const Node*) { return true; };
+    template <typename F>
+    bool QueryRadius(const Node* node, const Point& target, T& radius2, F& callback, int depth) const;
+    template <typename F>
+    void PairsWithinRadius(const Node* node, const Point& target, T radius2, int first, F& callback, int depth) const;
+    template <typename OutputIt>
+    OutputIt QueryBox(
+        const Node* node, const Point& min, const Point& max, Point& cellMin, Point& cellMax, OutputIt out, int depth) const;
+    template <typename OutputIt>
+    OutputIt ReportSubtree(const Node* node, OutputIt out) const;
+    void CountRadius(
+        const Node* node, const Point& target, T radius2, Point& cellMin, Point& cellMax, int limit, int* count, int depth) const;
+    void CountBox(const Node* node,
+                  const Point& min,
+                  const Point& max,
+                  Point& cellMin,
+                  Point& cellMax,
+                  int limit,
+                  int* count,
+                  int depth) const;
+    // Prefetches the cache lines of the node holding its first coordinates and its child pointers.
+    static void Prefetch(const Node* node);
+
+    void CollectStats(const Node* node,
+                      Point& cellMin,
+                      Point& cellMax,
+                      TreeStats& stats,
+                      double* aspectSum,
+                      size_t* aspectCells,
+                      int depth) const;
+
+    // Subtree deferred by an explicit stack traversal, visited later if its splitting plane is closer than the bound
+    struct DeferredNode
+    {
+        const Node* node;
+        T border2; // Squared distance from the target to the splitting plane of the parent
+        int depth;
+    };
+
+    // Nodes deferred at once are at most the tree height, which is at most 32 for median splits of up to INT_MAX points
+    static constexpr int maxStackSize = 64;
+
+    // Traversal state of a query of an interleaved batch
+    struct BatchQuery
+    {
+        BatchQuery();
+
+        const Point* target;
+        KnnResultSet result;
+        const Node* node; // Node visited next, null if the next deferred subtree has to be popped
+        int depth;
+        int top;
+        DeferredNode stack[maxStackSize];
+    };
+
+    // Returns the indices of the targets sorted along the curve through the bounding box of the tree.
+    std::vector<int> SortTargets(std::span<const Point> targets, BatchOrder order) const;
+
+    // Runs query(targets, results) on the targets in the given order and scatters the results back.
     template <typename F>
-    void QueryRadius(Node* root, const Point& target, T radius2, F* callback, int depth);
+    void QueryInOrder(std::span<const Point> targets, int k, std::span<QueryResult> results, BatchOrder order, F&& query) const;
+
+    void QueryBatch(std::span<const Point> targets, int k, std::span<QueryResult> results, int groupSize) const;
+
+    // Advances the query by a single node. Returns false if the query is finished.
+    bool StepBatchQuery(BatchQuery& query) const;
+
+    // Subtree deferred by a packet traversal with the targets of the packet that visit it, one bit per target
+    struct DeferredPacket
+    {
+        const Node* node;
+        uint64_t near; // Targets on the side of the subtree, they always visit it
+        uint64_t far;  // Targets on the other side, they visit it if the splitting plane is closer than their bound
+        T split;       // Coordinate of the splitting plane of the parent
+        int depth;
+    };
+
+    // A diverging packet defers both sides of a split
+    static constexpr int maxPacketStackSize = 2 * maxStackSize;
+
+    // Targets of a packet are processed in blocks of this many
+    static constexpr int packetBlockSize = 8;
+
+    void QueryPackets(std::span<const Point> targets, int k, std::span<QueryResult> results, int packetSize) const;
+
+    // Traverses the tree with count targets whose coordinates along axis a are coords[a * stride, a * stride + count).
+    void QueryPacket(const Point* targets, const T* coords, int stride, int count, KnnResultSet* results) const;
 
     Node* root;
-    std::vector<Node> nodes;
+    std::pmr::vector<Node> nodes;
 
-#if _DEBUG
-    int nodeCount = 0;
-#endif
+    // Bounding box of all points
+    Point lower, upper;
+
+    // Category bitmasks of every point and subtree, indexed like nodes
+    struct CategoryMask
+    {
+        uint64_t point;
+        uint64_t subtree;
+    };
+
+    std::vector<CategoryMask> categoryMasks;
+
+    // Build time breakdown of the last build
+    TreeStats buildTimes;
 };
 
 // Implementations
@@ -107,10 +699,12 @@ inline T& KDTree<K, T>::Point::operator[](int idx)
 }
 
 template <int K, typename T>
-inline KDTree<K, T>::Node::Node(const Point& p)
+inline KDTree<K, T>::Node::Node(const Point& p, int index)
     : point{ p }
     , left{ nullptr }
     , right{ nullptr }
+    , count{ 1 }
+    , index{ index }
 {
 }
 
@@ -127,6 +721,116 @@ inline bool KDTree<K, T>::QueryResult::operator<(const QueryResult& rhs) const
     return distance2 < rhs.distance2;
 }
 
+template <int K, typename T>
+inline KDTree<K, T>::KnnResultSet::KnnResultSet(int k)
+    : storage(k)
+    , results{ storage }
+    , size{ 0 }
+    , limit{ std::numeric_limits<T>::max() }
+{
+}
+
+template <int K, typename T>
+inline KDTree<K, T>::KnnResultSet::KnnResultSet(std::span<QueryResult> buffer)
+    : results{ buffer }
+    , size{ 0 }
+    , limit{ std::numeric_limits<T>::max() }
+{
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::KnnResultSet::Clear()
+{
+    size = 0;
+    limit = std::numeric_limits<T>::max();
+}
+
+template <int K, typename T>
+inline T KDTree<K, T>::KnnResultSet::Bound() const
+{
+    if (results.empty())
+    {
+        return 0;
+    }
+
+    if (!Full())
+    {
+        return limit;
+    }
+
+    // The farthest result is at the back of the sorted array or at the front of the heap
+    return Capacity() <= maxSortedSize ? results.back().distance2 : results.front().distance2;
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::KnnResultSet::Insert(T distance2, const Node* node)
+{
+    assert(distance2 < Bound());
+
+    if (Capacity() <= maxSortedSize)
+    {
+        // Shift farther results to the right, dropping the farthest one if full
+        int i = Full() ? size - 1 : size++;
+        for (; i > 0 && distance2 < results[i - 1].distance2; --i)
+        {
+            results[i] = results[i - 1];
+        }
+
+        results[i] = QueryResult{ distance2, node };
+    }
+    else if (!Full())
+    {
+        results[size++] = QueryResult{ distance2, node };
+        std::push_heap(results.begin(), results.begin() + size);
+    }
+    else
+    {
+        std::pop_heap(results.begin(), results.end());
+        results.back() = QueryResult{ distance2, node };
+        std::push_heap(results.begin(), results.end());
+    }
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::KnnResultSet::Sort()
+{
+    if (Capacity() > maxSortedSize)
+    {
+        std::sort_heap(results.begin(), results.begin() + size);
+    }
+}
+
+template <int K, typename T>
+inline int KDTree<K, T>::KnnResultSet::Capacity() const
+{
+    return (int)results.size();
+}
+
+template <int K, typename T>
+inline int KDTree<K, T>::KnnResultSet::Size() const
+{
+    return size;
+}
+
+template <int K, typename T>
+inline bool KDTree<K, T>::KnnResultSet::Full() const
+{
+    return size == Capacity();
+}
+
+template <int K, typename T>
+inline std::span<const typename KDTree<K, T>::QueryResult> KDTree<K, T>::KnnResultSet::Results() const
+{
+    return results.first(size);
+}
+
+template <int K, typename T>
+inline const typename KDTree<K, T>::QueryResult& KDTree<K, T>::KnnResultSet::operator[](int idx) const
+{
+    assert(idx < size);
+    return results[idx];
+}
+
 template <int K, typename T>
 inline T KDTree<K, T>::dist2(const Point& p1, const Point& p2)
 {
@@ -141,7 +845,9 @@ inline T KDTree<K, T>::dist2(const Point& p1, const Point& p2)
 }
 
 template <int K, typename T>
-inline KDTree<K, T>::KDTree(const std::span<Point>& points)
+inline KDTree<K, T>::KDTree(const std::span<Point>& points, std::pmr::memory_resource* resource)
+    : root{ nullptr }
+    , nodes{ resource }
 {
     BuildTree(points);
 }
@@ -155,35 +861,74 @@ inline KDTree<K, T>::~KDTree()
 template <int K, typename T>
 inline void KDTree<K, T>::BuildTree(const std::span<Point>& points)
 {
+    using clock = std::chrono::steady_clock;
+    auto seconds = [](clock::time_point begin, clock::time_point end) {
+        return std::chrono::duration<double>(end - begin).count();
+    };
+
     if (root != nullptr)
     {
         DeleteTree();
     }
 
-    // Reserve nodes
-    size_t bufferSize = compute_size(points.size());
-    nodes.reserve(bufferSize);
+    auto start = clock::now();
+
+    // Every point becomes exactly one node, storage of a larger previous tree is released
+    if (nodes.capacity() != points.size())
+    {
+        nodes = std::pmr::vector<Node>{ nodes.get_allocator() };
+        nodes.reserve(points.size());
+    }
 
     // Build tree with points indices vector to preserve original data
     std::vector<int> indices(points.size());
     std::iota(indices.begin(), indices.end(), 0);
 
+    auto allocated = clock::now();
+
     root = BuildTree(points, indices.data(), (int)points.size(), 0);
+
+    auto partitioned = clock::now();
+
+    // Compute bounding box, every cell of the tree is a sub box of it
+    for (int i = 0; i < K; ++i)
+    {
+        lower[i] = std::numeric_limits<T>::max();
+        upper[i] = std::numeric_limits<T>::lowest();
+    }
+
+    for (const Point& p : points)
+    {
+        for (int i = 0; i < K; ++i)
+        {
+            lower[i] = std::min(lower[i], p[i]);
+            upper[i] = std::max(upper[i], p[i]);
+        }
+    }
+
+    auto end = clock::now();
+
+    buildTimes.buildSeconds = seconds(start, end);
+    buildTimes.allocateSeconds = seconds(start, allocated);
+    buildTimes.partitionSeconds = seconds(allocated, partitioned);
+    buildTimes.boundsSeconds = seconds(partitioned, end);
 }
 
 template <int K, typename T>
 inline void KDTree<K, T>::DeleteTree()
 {
     nodes.clear();
+    categoryMasks.clear();
     root = nullptr;
 }
 
 template <int K, typename T>
-inline typename KDTree<K, T>::QueryResult KDTree<K, T>::QueryNearestNeighbor(const Point& target)
+inline typename KDTree<K, T>::QueryResult KDTree<K, T>::QueryNearestNeighbor(const Point& target) const
 {
     assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
 
-    Node* nn;
+    const Node* nn = nullptr;
     T d = std::numeric_limits<T>::max();
     QueryNearestNeighbor(root, target, &nn, &d, 0);
 
@@ -191,171 +936,1345 @@ inline typename KDTree<K, T>::QueryResult KDTree<K, T>::QueryNearestNeighbor(con
 }
 
 template <int K, typename T>
-inline std::vector<typename KDTree<K, T>::QueryResult> KDTree<K, T>::QueryKNearestNeighbors(const Point& target, int k)
+inline typename KDTree<K, T>::QueryResult KDTree<K, T>::QueryNearestNeighbor(const Point& target, const Node* previous) const
 {
     assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
 
-    // Priority queue
-    std::vector<QueryResult> pq;
-    pq.reserve(k + 1);
-
-    QueryKNearestNeighbors(root, target, k, pq, 0);
+    // Only points closer than the previous neighbor replace it
+    const Node* nn = previous != nullptr ? previous : root;
+    T d = dist2(target, nn->point);
+    QueryNearestNeighbor(root, target, &nn, &d, 0);
 
-    return pq;
+    return QueryResult{ d, nn };
 }
 
 template <int K, typename T>
-template <typename F>
-inline void KDTree<K, T>::QueryRadius(const Point& target, T radius, F* callback)
+inline void KDTree<K, T>::QueryKNearestNeighbors(const Point& target,
+                                                 KnnResultSet& result,
+                                                 std::span<const QueryResult> previous) const
 {
     assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
 
-    QueryRadius(root, target, radius * radius, callback, 0);
-}
+    // Any k points bound the distance of the k-th neighbor. previous is read before the set is written.
+    int k = result.Capacity();
+    int seeds = 0;
+    T bound = 0;
+    for (const QueryResult& r : previous)
+    {
+        if (r.node != nullptr && seeds < k)
+        {
+            bound = std::max(bound, dist2(target, r.node->point));
+            ++seeds;
+        }
+    }
+
+    result.Clear();
+
+    // The bound is exclusive, the k-th neighbor may be a previous one right at it
+    if (seeds == k && k > 0)
+    {
+        result.limit = std::nextafter(bound, std::numeric_limits<T>::max());
+    }
+
+    QueryKNearestNeighbors(root, target, result, acceptAll, acceptAll, 0);
+    result.Sort();
+}
+
+template <int K, typename T>
+inline std::vector<typename KDTree<K, T>::QueryResult> KDTree<K, T>::QueryKNearestNeighbors(const Point& target, int k) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    // Priority queue
+    std::vector<QueryResult> pq;
+    pq.reserve(k + 1);
+
+    QueryKNearestNeighbors(root, target, k, pq, 0);
+
+    return pq;
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryKNearestNeighbors(const Point& target, KnnResultSet& result) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    result.Clear();
+    QueryKNearestNeighbors(root, target, result, acceptAll, acceptAll, 0);
+    result.Sort();
+}
+
+template <int K, typename T>
+inline int KDTree<K, T>::QueryKNearestNeighbors(const Point& target, std::span<QueryResult> out) const
+{
+    KnnResultSet result{ out };
+    QueryKNearestNeighbors(target, result);
+
+    return result.Size();
+}
+
+template <int K, typename T>
+template <typename P>
+    requires std::predicate<P&, const typename KDTree<K, T>::Node*>
+inline typename KDTree<K, T>::QueryResult KDTree<K, T>::QueryNearestNeighbor(const Point& target, P&& predicate) const
+{
+    QueryResult nn{ std::numeric_limits<T>::max(), nullptr };
+    KnnResultSet result{ std::span{ &nn, 1 } };
+
+    QueryKNearestNeighbors(target, result, predicate);
+
+    return nn;
+}
+
+template <int K, typename T>
+template <typename P>
+    requires std::predicate<P&, const typename KDTree<K, T>::Node*>
+inline void KDTree<K, T>::QueryKNearestNeighbors(const Point& target, KnnResultSet& result, P&& predicate) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    result.Clear();
+    QueryKNearestNeighbors(root, target, result, predicate, acceptAll, 0);
+    result.Sort();
+}
+
+template <int K, typename T>
+template <typename F>
+inline void KDTree<K, T>::BuildCategoryMasks(F&& category)
+{
+    categoryMasks.resize(nodes.size());
+
+    // Children come after their parent in pre-order, so a reverse pass visits them first
+    for (size_t i = nodes.size(); i-- > 0;)
+    {
+        const Node& node = nodes[i];
+
+        uint64_t mask = category(node.point);
+        categoryMasks[i].point = mask;
+
+        for (const Node* child : { node.left, node.right })
+        {
+            if (child != nullptr)
+            {
+                mask |= categoryMasks[child - nodes.data()].subtree;
+            }
+        }
+
+        categoryMasks[i].subtree = mask;
+    }
+}
+
+template <int K, typename T>
+template <typename P>
+    requires std::predicate<P&, const typename KDTree<K, T>::Node*>
+inline typename KDTree<K, T>::QueryResult KDTree<K, T>::QueryNearestNeighbor(
+    const Point& target, uint64_t categories, P&& predicate) const
+{
+    QueryResult nn{ std::numeric_limits<T>::max(), nullptr };
+    KnnResultSet result{ std::span{ &nn, 1 } };
+
+    QueryKNearestNeighbors(target, result, categories, predicate);
+
+    return nn;
+}
+
+template <int K, typename T>
+template <typename P>
+    requires std::predicate<P&, const typename KDTree<K, T>::Node*>
+inline void KDTree<K, T>::QueryKNearestNeighbors(
+    const Point& target, KnnResultSet& result, uint64_t categories, P&& predicate) const
+{
+    assert(root != nullptr);
+    assert(categoryMasks.size() == nodes.size() && "Category masks are not built");
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    auto filter = [&](const Node* node) {
+        return (categoryMasks[node - nodes.data()].point & categories) != 0 && predicate(node);
+    };
+    auto subtreeFilter = [&](const Node* node) { return (categoryMasks[node - nodes.data()].subtree & categories) != 0; };
+
+    result.Clear();
+    QueryKNearestNeighbors(root, target, result, filter, subtreeFilter, 0);
+    result.Sort();
+}
+
+template <int K, typename T>
+template <typename F>
+    requires requires(F* f, T d, const typename KDTree<K, T>::Node* n) { f->QueryRadiusCallback(d, n); }
+inline void KDTree<K, T>::QueryRadius(const Point& target, T radius, F* callback) const
+{
+    QueryRadius(target, radius,
+                [callback](T distance2, const Node* node) { return callback->QueryRadiusCallback(distance2, node); });
+}
+
+template <int K, typename T>
+template <typename F>
+    requires std::invocable<F&, T, const typename KDTree<K, T>::Node*>
+inline void KDTree<K, T>::QueryRadius(const Point& target, T radius, F&& callback) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    T radius2 = radius * radius;
+    QueryRadius(root, target, radius2, callback, 0);
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryRadius(
+    const Point& target, T radius, std::vector<QueryResult>& out, bool sorted, size_t maxResults) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    out.clear();
+    if (maxResults == 0)
+    {
+        return;
+    }
+
+    T radius2 = radius * radius;
+    bool heap = false;
+
+    auto collect = [&](T distance2, const Node* node) {
+        if (!heap)
+        {
+            out.emplace_back(distance2, node);
+
+            // Switch to a bounded max-heap once the cap is reached
+            if (out.size() == maxResults)
+            {
+                std::make_heap(out.begin(), out.end());
+                radius2 = out.front().distance2;
+                heap = true;
+            }
+        }
+        else
+        {
+            // Only points closer than the current farthest result are reported
+            std::pop_heap(out.begin(), out.end());
+            out.back() = QueryResult{ distance2, node };
+            std::push_heap(out.begin(), out.end());
+            radius2 = out.front().distance2;
+        }
+    };
+
+    QueryRadius(root, target, radius2, collect, 0);
+
+    if (sorted)
+    {
+        if (heap)
+        {
+            std::sort_heap(out.begin(), out.end());
+        }
+        else
+        {
+            std::sort(out.begin(), out.end());
+        }
+    }
+}
+
+template <int K, typename T>
+template <typename OutputIt>
+inline OutputIt KDTree<K, T>::QueryBox(const Point& min, const Point& max, OutputIt out) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    Point cellMin = lower;
+    Point cellMax = upper;
+
+    return QueryBox(root, min, max, cellMin, cellMax, out, 0);
+}
+
+template <int K, typename T>
+inline int KDTree<K, T>::CountRadius(const Point& target, T radius) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    Point cellMin = lower;
+    Point cellMax = upper;
+
+    int count = 0;
+    CountRadius(root, target, radius * radius, cellMin, cellMax, std::numeric_limits<int>::max(), &count, 0);
+
+    return count;
+}
+
+template <int K, typename T>
+inline int KDTree<K, T>::CountBox(const Point& min, const Point& max) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    Point cellMin = lower;
+    Point cellMax = upper;
+
+    int count = 0;
+    CountBox(root, min, max, cellMin, cellMax, std::numeric_limits<int>::max(), &count, 0);
+
+    return count;
+}
+
+template <int K, typename T>
+inline bool KDTree<K, T>::CountRadiusAtLeast(const Point& target, T radius, int n) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    Point cellMin = lower;
+    Point cellMax = upper;
+
+    int count = 0;
+    CountRadius(root, target, radius * radius, cellMin, cellMax, n, &count, 0);
+
+    return count >= n;
+}
+
+template <int K, typename T>
+inline bool KDTree<K, T>::CountBoxAtLeast(const Point& min, const Point& max, int n) const
+{
+    assert(root != nullptr);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+
+    Point cellMin = lower;
+    Point cellMax = upper;
+
+    int count = 0;
+    CountBox(root, min, max, cellMin, cellMax, n, &count, 0);
+
+    return count >= n;
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryNearestNeighbors(std::span<const Point> targets,
+                                                 std::span<QueryResult> results,
+                                                 int groupSize,
+                                                 BatchOrder order) const
+{
+    QueryInOrder(targets, 1, results, order, [&](std::span<const Point> ordered, std::span<QueryResult> out) {
+        QueryBatch(ordered, 1, out, groupSize > 0 ? groupSize : order == BatchOrder::Input ? 16 : 1);
+    });
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryKNearestNeighbors(
+    std::span<const Point> targets, int k, std::span<QueryResult> results, int groupSize, BatchOrder order) const
+{
+    QueryInOrder(targets, k, results, order, [&](std::span<const Point> ordered, std::span<QueryResult> out) {
+        QueryBatch(ordered, k, out, groupSize > 0 ? groupSize : order == BatchOrder::Input ? 16 : 1);
+    });
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryNearestNeighborsPacket(std::span<const Point> targets,
+                                                       std::span<QueryResult> results,
+                                                       int packetSize,
+                                                       BatchOrder order) const
+{
+    QueryInOrder(targets, 1, results, order, [&](std::span<const Point> ordered, std::span<QueryResult> out) {
+        QueryPackets(ordered, 1, out, packetSize);
+    });
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryKNearestNeighborsPacket(std::span<const Point> targets,
+                                                        int k,
+                                                        std::span<QueryResult> results,
+                                                        int packetSize,
+                                                        BatchOrder order) const
+{
+    QueryInOrder(targets, k, results, order, [&](std::span<const Point> ordered, std::span<QueryResult> out) {
+        QueryPackets(ordered, k, out, packetSize);
+    });
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::AllKNearestNeighbors(int k, std::span<int> indices, std::span<T> distances2, int threadCount) const
+{
+    assert(indices.size() >= nodes.size() * k);
+    assert(distances2.size() >= nodes.size() * k);
+
+    int n = (int)nodes.size();
+
+    // Points are processed in tree order, so consecutive queries touch the same part of the tree
+    ParallelFor(n, threadCount, [&](int begin, int end, int) {
+        KnnResultSet result(k);
+
+        for (int i = begin; i < end; ++i)
+        {
+            const Node* node = &nodes[i];
+            result.Clear();
+
+            // Nodes next to each other in pre-order are close in space.
+            // Seeding the result with them gives a tight bound before descending from the root.
+            int windowBegin = std::max(0, i - k);
+            int windowEnd = std::min(n, i + k + 1);
+            for (int j = windowBegin; j < windowEnd; ++j)
+            {
+                T d = dist2(node->point, nodes[j].point);
+                if (j != i && d < result.Bound())
+                {
+                    result.Insert(d, &nodes[j]);
+                }
+            }
+
+            auto notSeeded = [&](const Node* other) {
+                int j = int(other - nodes.data());
+                return j < windowBegin || j >= windowEnd;
+            };
+
+            QueryKNearestNeighbors(root, node->point, result, notSeeded, acceptAll, 0);
+            result.Sort();
+
+            int* rowIndices = indices.data() + size_t(node->index) * k;
+            T* rowDistances = distances2.data() + size_t(node->index) * k;
+            for (int j = 0; j < k; ++j)
+            {
+                bool found = j < result.Size();
+                rowIndices[j] = found ? result[j].node->index : -1;
+                rowDistances[j] = found ? result[j].distance2 : std::numeric_limits<T>::max();
+            }
+        }
+    });
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::AllPairsWithinRadius(T radius, NeighborList& out, bool unique, int threadCount) const
+{
+    int n = (int)nodes.size();
+    T radius2 = radius * radius;
+
+    if (threadCount <= 0)
+    {
+        threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    // (row, column) entries found by each thread
+    std::vector<std::vector<std::pair<int, int>>> buffers(threadCount);
+
+    // Each pair is found once from the node that comes first in pre-order
+    ParallelFor(n, threadCount, [&](int begin, int end, int thread) {
+        auto& buffer = buffers[thread];
+
+        for (int i = begin; i < end; ++i)
+        {
+            const Node* node = &nodes[i];
+
+            auto emit = [&](const Node* other) {
+                int a = node->index;
+                int b = other->index;
+
+                if (unique)
+                {
+                    buffer.emplace_back(std::min(a, b), std::max(a, b));
+                }
+                else
+                {
+                    buffer.emplace_back(a, b);
+                    buffer.emplace_back(b, a);
+                }
+            };
+
+            PairsWithinRadius(root, node->point, radius2, i + 1, emit, 0);
+        }
+    });
+
+    // Merge the thread buffers into compressed rows
+    out.offsets.assign(n + 1, 0);
+    for (const auto& buffer : buffers)
+    {
+        for (const auto& [row, column] : buffer)
+        {
+            ++out.offsets[row + 1];
+        }
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        out.offsets[i + 1] += out.offsets[i];
+    }
+
+    std::vector<int> cursor(out.offsets.begin(), out.offsets.end() - 1);
+    out.indices.resize(out.offsets[n]);
+
+    for (const auto& buffer : buffers)
+    {
+        for (const auto& [row, column] : buffer)
+        {
+            out.indices[cursor[row]++] = column;
+        }
+    }
+}
+
+template <int K, typename T>
+inline typename KDTree<K, T>::TreeStats KDTree<K, T>::GetStats() const
+{
+    TreeStats stats = buildTimes;
+
+    stats.nodeCount = nodes.size();
+    stats.memoryUsed = nodes.size() * sizeof(Node);
+    stats.memoryReserved = nodes.capacity() * sizeof(Node);
+
+    Point cellMin = lower;
+    Point cellMax = upper;
+
+    double aspectSum = 0;
+    size_t aspectCells = 0;
+    CollectStats(root, cellMin, cellMax, stats, &aspectSum, &aspectCells, 0);
+
+    stats.averageAspectRatio = aspectCells > 0 ? aspectSum / aspectCells : 0;
+
+    return stats;
+}
+
+template <int K, typename T>
+inline const typename KDTree<K, T>::Node* KDTree<K, T>::GetRootNode() const
+{
+    return root;
+}
+
+template <int K, typename T>
+inline std::span<const typename KDTree<K, T>::Node> KDTree<K, T>::GetNodes() const
+{
+    return nodes;
+}
+
+template <int K, typename T>
+inline typename KDTree<K, T>::Node* KDTree<K, T>::BuildTree(const std::span<Point>& points, int* indices, int count, int depth)
+{
+    if (count <= 0)
+    {
+        return nullptr;
+    }
+
+    int axis = depth % K;
+    int mid = count / 2;
+
+    std::nth_element(indices, indices + mid, indices + count,
+                     [&](int left, int right) { return points[left][axis] < points[right][axis]; });
+
+    // Children point into nodes, which must not reallocate
+    assert(nodes.size() < nodes.capacity());
+
+    // Create kd tree node
+    Node& node = nodes.emplace_back(points[indices[mid]], indices[mid]);
+
+    // Build left and right sub trees recursively
+    node.left = BuildTree(points, indices, mid, depth + 1);
+    node.right = BuildTree(points, indices + mid + 1, count - mid - 1, depth + 1);
+    node.count = count;
+
+    return &node;
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::Prefetch(const Node* node)
+{
+    if (node != nullptr)
+    {
+        KD_TREE_PREFETCH_ADDRESS(node);
+        if constexpr (offsetof(Node, left) >= 64)
+        {
+            KD_TREE_PREFETCH_ADDRESS(&node->left);
+        }
+    }
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryNearestNeighbor(
+    const Node* node, const Point& target, const Node** nearest, T* minDist, int depth) const
+{
+    // The far side of every split is deferred and visited if its border is closer than the nearest point
+    DeferredNode stack[maxStackSize];
+    int top = 0;
+
+    while (true)
+    {
+        // Descend to a leaf along the nearer sides
+        while (node != nullptr)
+        {
+            // Both children are loaded while the distance to the node is computed
+            Prefetch(node->left);
+            Prefetch(node->right);
+
+            KD_TREE_STAT(kd_tree_stats::Visit(node, depth));
+
+            T d = dist2(target, node->point);
+            KD_TREE_STAT(++GetQueryStats().distanceEvaluations);
+            if (d < *minDist)
+            {
+                *minDist = d;
+                *nearest = node;
+            }
+
+            const Node* next;
+            const Node* other;
+
+            // Compare axis for current depth and find next branch to descend
+            int axis = depth % K;
+            if (target[axis] < node->point[axis])
+            {
+                next = node->left;
+                other = node->right;
+            }
+            else
+            {
+                next = node->right;
+                other = node->left;
+            }
+
+            if (other != nullptr)
+            {
+                assert(top < maxStackSize);
+
+                T border = target[axis] - node->point[axis];
+                stack[top++] = DeferredNode{ other, border * border, depth + 1 };
+            }
+
+            node = next;
+            ++depth;
+        }
+
+        // Resume at the most recently deferred subtree the nearest point may lie in
+        while (true)
+        {
+            if (top == 0)
+            {
+                return;
+            }
+
+            const DeferredNode& deferred = stack[--top];
+            if (*minDist > deferred.border2)
+            {
+                KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, true));
+                node = deferred.node;
+                depth = deferred.depth;
+                break;
+            }
+
+            KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, false));
+        }
+    }
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryKNearestNeighbors(
+    const Node* node, const Point& target, int k, std::vector<QueryResult>& pq, int depth) const
+{
+    DeferredNode stack[maxStackSize];
+    int top = 0;
+
+    const size_t size = size_t(k);
+
+    auto bound = [&]() { return pq.size() < size ? std::numeric_limits<T>::max() : pq.front().distance2; };
+
+    while (true)
+    {
+        while (node != nullptr)
+        {
+            Prefetch(node->left);
+            Prefetch(node->right);
+
+            KD_TREE_STAT(kd_tree_stats::Visit(node, depth));
+
+            T d = dist2(target, node->point);
+            KD_TREE_STAT(++GetQueryStats().distanceEvaluations);
+            if (pq.size() < size || d < pq.front().distance2)
+            {
+                pq.emplace_back(d, node);
+                std::push_heap(pq.begin(), pq.end());
+
+                if (pq.size() > size)
+                {
+                    std::pop_heap(pq.begin(), pq.end());
+                    pq.pop_back();
+                }
+            }
+
+            const Node* next;
+            const Node* other;
+
+            int axis = depth % K;
+            if (target[axis] < node->point[axis])
+            {
+                next = node->left;
+                other = node->right;
+            }
+            else
+            {
+                next = node->right;
+                other = node->left;
+            }
+
+            if (other != nullptr)
+            {
+                assert(top < maxStackSize);
+
+                T border = target[axis] - node->point[axis];
+                stack[top++] = DeferredNode{ other, border * border, depth + 1 };
+            }
+
+            node = next;
+            ++depth;
+        }
+
+        while (true)
+        {
+            if (top == 0)
+            {
+                return;
+            }
+
+            const DeferredNode& deferred = stack[--top];
+            if (deferred.border2 < bound())
+            {
+                KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, true));
+                node = deferred.node;
+                depth = deferred.depth;
+                break;
+            }
+
+            KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, false));
+        }
+    }
+}
+
+template <int K, typename T>
+template <typename Filter, typename SubtreeFilter>
+inline void KDTree<K, T>::QueryKNearestNeighbors(const Node* node,
+                                                 const Point& target,
+                                                 KnnResultSet& result,
+                                                 Filter& filter,
+                                                 SubtreeFilter& subtreeFilter,
+                                                 int depth) const
+{
+    DeferredNode stack[maxStackSize];
+    int top = 0;
+
+    while (true)
+    {
+        // Subtrees rejected by the subtree filter are skipped like empty ones
+        while (node != nullptr && subtreeFilter(node))
+        {
+            Prefetch(node->left);
+            Prefetch(node->right);
+
+            KD_TREE_STAT(kd_tree_stats::Visit(node, depth));
+
+            T d = dist2(target, node->point);
+            KD_TREE_STAT(++GetQueryStats().distanceEvaluations);
+            if (d < result.Bound() && filter(node))
+            {
+                result.Insert(d, node);
+            }
+
+            const Node* next;
+            const Node* other;
+
+            int axis = depth % K;
+            if (target[axis] < node->point[axis])
+            {
+                next = node->left;
+                other = node->right;
+            }
+            else
+            {
+                next = node->right;
+                other = node->left;
+            }
+
+            if (other != nullptr)
+            {
+                assert(top < maxStackSize);
+
+                T border = target[axis] - node->point[axis];
+                stack[top++] = DeferredNode{ other, border * border, depth + 1 };
+            }
+
+            node = next;
+            ++depth;
+        }
+
+        while (true)
+        {
+            if (top == 0)
+            {
+                return;
+            }
+
+            const DeferredNode& deferred = stack[--top];
+            if (deferred.border2 < result.Bound())
+            {
+                KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, true));
+                node = deferred.node;
+                depth = deferred.depth;
+                break;
+            }
+
+            KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, false));
+        }
+    }
+}
+
+template <int K, typename T>
+template <typename F>
+inline bool KDTree<K, T>::QueryRadius(const Node* node, const Point& target, T& radius2, F& callback, int depth) const
+{
+    if (node == nullptr)
+    {
+        return true;
+    }
+
+    KD_TREE_STAT(kd_tree_stats::Visit(node, depth));
+
+    T d = dist2(target, node->point);
+    KD_TREE_STAT(++GetQueryStats().distanceEvaluations);
+    if (d < radius2)
+    {
+        if constexpr (std::is_void_v<std::invoke_result_t<F&, T, const Node*>>)
+        {
+            std::invoke(callback, d, node);
+        }
+        else
+        {
+            QueryControl control = std::invoke(callback, d, node);
+            if (control == QueryControl::Stop)
+            {
+                return false;
+            }
+            else if (control == QueryControl::Shrink)
+            {
+                radius2 = d;
+            }
+        }
+    }
+
+    const Node* next;
+    const Node* other;
+
+    // Compare axis for current depth and find next branch to descend
+    int axis = depth % K;
+    if (target[axis] < node->point[axis])
+    {
+        next = node->left;
+        other = node->right;
+    }
+    else
+    {
+        next = node->right;
+        other = node->left;
+    }
+
+    if (!QueryRadius(next, target, radius2, callback, depth + 1))
+    {
+        return false;
+    }
+
+    // The radius may have been shrunk by the callback
+    T border = target[axis] - node->point[axis];
+    if (radius2 > border * border)
+    {
+        KD_TREE_STAT(kd_tree_stats::Branch(other, true));
+        return QueryRadius(other, target, radius2, callback, depth + 1);
+    }
+
+    KD_TREE_STAT(kd_tree_stats::Branch(other, false));
+    return true;
+}
 
 template <int K, typename T>
-inline const typename KDTree<K, T>::Node* KDTree<K, T>::GetRootNode() const
+template <typename F>
+inline void KDTree<K, T>::PairsWithinRadius(
+    const Node* node, const Point& target, T radius2, int first, F& callback, int depth) const
 {
-    return root;
+    // Skip subtrees that lie entirely before the first node to consider in pre-order
+    if (node == nullptr || int(node - nodes.data()) + node->count <= first)
+    {
+        return;
+    }
+
+    if (int(node - nodes.data()) >= first && dist2(target, node->point) < radius2)
+    {
+        callback(node);
+    }
+
+    int axis = depth % K;
+    T border = target[axis] - node->point[axis];
+
+    if (border < 0 || border * border < radius2)
+    {
+        PairsWithinRadius(node->left, target, radius2, first, callback, depth + 1);
+    }
+
+    if (border >= 0 || border * border < radius2)
+    {
+        PairsWithinRadius(node->right, target, radius2, first, callback, depth + 1);
+    }
 }
 
 template <int K, typename T>
-inline typename KDTree<K, T>::Node* KDTree<K, T>::BuildTree(const std::span<Point>& points, int* indices, int count, int depth)
+template <typename OutputIt>
+inline OutputIt KDTree<K, T>::QueryBox(
+    const Node* node, const Point& min, const Point& max, Point& cellMin, Point& cellMax, OutputIt out, int depth) const
 {
-    if (count <= 0)
+    if (node == nullptr)
     {
-        return nullptr;
+        return out;
     }
 
-    int axis = depth % K;
-    int mid = count / 2;
+    KD_TREE_STAT(kd_tree_stats::Visit(node, depth));
 
-    std::nth_element(indices, indices + mid, indices + count,
-                     [&](int left, int right) { return points[left][axis] < points[right][axis]; });
+    // Report the whole subtree without testing points if the cell is inside the box
+    bool contained = true;
+    bool inside = true;
+    for (int i = 0; i < K; ++i)
+    {
+        contained = contained && min[i] <= cellMin[i] && cellMax[i] <= max[i];
+        inside = inside && min[i] <= node->point[i] && node->point[i] <= max[i];
+    }
 
-    // Create kd tree node
-    Node& node = nodes.emplace_back(points[indices[mid]]);
+    if (contained)
+    {
+        return ReportSubtree(node, out);
+    }
 
-#if _DEBUG
-    ++nodeCount;
-    assert(nodeCount < nodes.capacity());
-#endif
+    if (inside)
+    {
+        *out++ = node;
+    }
 
-    // Build left and right sub trees recursively
-    node.left = BuildTree(points, indices, mid, depth + 1);
-    node.right = BuildTree(points, indices + mid + 1, count - mid - 1, depth + 1);
+    // Left subtree holds points at or below the split value, right subtree at or above it
+    int axis = depth % K;
+    T split = node->point[axis];
 
-    return &node;
+    if (min[axis] <= split)
+    {
+        T saved = cellMax[axis];
+        cellMax[axis] = split;
+        out = QueryBox(node->left, min, max, cellMin, cellMax, out, depth + 1);
+        cellMax[axis] = saved;
+    }
+    else
+    {
+        KD_TREE_STAT(kd_tree_stats::Branch(node->left, false));
+    }
+
+    if (max[axis] >= split)
+    {
+        T saved = cellMin[axis];
+        cellMin[axis] = split;
+        out = QueryBox(node->right, min, max, cellMin, cellMax, out, depth + 1);
+        cellMin[axis] = saved;
+    }
+    else
+    {
+        KD_TREE_STAT(kd_tree_stats::Branch(node->right, false));
+    }
+
+    return out;
 }
 
 template <int K, typename T>
-inline void KDTree<K, T>::QueryNearestNeighbor(Node* node, const Point& target, Node** nearest, T* minDist, int depth)
+template <typename OutputIt>
+inline OutputIt KDTree<K, T>::ReportSubtree(const Node* node, OutputIt out) const
 {
     if (node == nullptr)
+    {
+        return out;
+    }
+
+    // The subtree root has already been visited
+    KD_TREE_STAT(GetQueryStats().nodesVisited += node->count - 1);
+
+    // Nodes are stored in pre-order, so a subtree is a contiguous range of nodes
+    for (int i = 0; i < node->count; ++i)
+    {
+        *out++ = node + i;
+    }
+
+    return out;
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::CountRadius(
+    const Node* node, const Point& target, T radius2, Point& cellMin, Point& cellMax, int limit, int* count, int depth) const
+{
+    if (node == nullptr || *count >= limit)
     {
         return;
     }
 
-    T d = dist2(target, node->point);
-    if (d < *minDist)
+    KD_TREE_STAT(kd_tree_stats::Visit(node, depth));
+
+    // Squared distances from the target to the nearest and farthest points of the cell
+    T near2 = 0;
+    T far2 = 0;
+    for (int i = 0; i < K; ++i)
     {
-        *minDist = d;
-        *nearest = node;
+        T lo = cellMin[i] - target[i];
+        T hi = target[i] - cellMax[i];
+        T near = std::max(T(0), std::max(lo, hi));
+        T far = std::max(std::abs(lo), std::abs(hi));
+
+        near2 += near * near;
+        far2 += far * far;
     }
 
-    Node* next;
-    Node* other;
+    if (near2 >= radius2)
+    {
+        KD_TREE_STAT(++GetQueryStats().branchesPruned);
+        return;
+    }
+
+    if (far2 < radius2)
+    {
+        *count += node->count;
+        return;
+    }
+
+    KD_TREE_STAT(++GetQueryStats().distanceEvaluations);
+    if (dist2(target, node->point) < radius2)
+    {
+        ++*count;
+    }
 
-    // Compare axis for current depth and find next branch to descend
     int axis = depth % K;
-    if (target[axis] < node->point[axis])
+    T split = node->point[axis];
+
+    T saved = cellMax[axis];
+    cellMax[axis] = split;
+    CountRadius(node->left, target, radius2, cellMin, cellMax, limit, count, depth + 1);
+    cellMax[axis] = saved;
+
+    saved = cellMin[axis];
+    cellMin[axis] = split;
+    CountRadius(node->right, target, radius2, cellMin, cellMax, limit, count, depth + 1);
+    cellMin[axis] = saved;
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::CountBox(
+    const Node* node, const Point& min, const Point& max, Point& cellMin, Point& cellMax, int limit, int* count, int depth) const
+{
+    if (node == nullptr || *count >= limit)
     {
-        next = node->left;
-        other = node->right;
+        return;
     }
-    else
+
+    KD_TREE_STAT(kd_tree_stats::Visit(node, depth));
+
+    bool contained = true;
+    bool inside = true;
+    for (int i = 0; i < K; ++i)
     {
-        next = node->right;
-        other = node->left;
+        contained = contained && min[i] <= cellMin[i] && cellMax[i] <= max[i];
+        inside = inside && min[i] <= node->point[i] && node->point[i] <= max[i];
+    }
+
+    if (contained)
+    {
+        *count += node->count;
+        return;
     }
 
-    // Recurse down the branch that's best according to the current depth
-    QueryNearestNeighbor(next, target, nearest, minDist, depth + 1);
+    if (inside)
+    {
+        ++*count;
+    }
 
-    // We may need to check the other side of the tree
-    // If the other side is closer than the radius, then we must recurse to the other side as well
-    T border = target[axis] - node->point[axis];
-    if (*minDist > border * border)
+    int axis = depth % K;
+    T split = node->point[axis];
+
+    if (min[axis] <= split)
+    {
+        T saved = cellMax[axis];
+        cellMax[axis] = split;
+        CountBox(node->left, min, max, cellMin, cellMax, limit, count, depth + 1);
+        cellMax[axis] = saved;
+    }
+    else
+    {
+        KD_TREE_STAT(kd_tree_stats::Branch(node->left, false));
+    }
+
+    if (max[axis] >= split)
     {
-        QueryNearestNeighbor(other, target, nearest, minDist, depth + 1);
+        T saved = cellMin[axis];
+        cellMin[axis] = split;
+        CountBox(node->right, min, max, cellMin, cellMax, limit, count, depth + 1);
+        cellMin[axis] = saved;
+    }
+    else
+    {
+        KD_TREE_STAT(kd_tree_stats::Branch(node->right, false));
     }
 }
 
 template <int K, typename T>
-inline void KDTree<K, T>::QueryKNearestNeighbors(Node* node, const Point& target, int k, std::vector<QueryResult>& pq, int depth)
+inline void KDTree<K, T>::CollectStats(
+    const Node* node, Point& cellMin, Point& cellMax, TreeStats& stats, double* aspectSum, size_t* aspectCells, int depth) const
 {
     if (node == nullptr)
     {
         return;
     }
 
-    T d = dist2(target, node->point);
-    if (pq.size() < k || d < pq.front().distance2)
+    if (stats.height <= depth)
+    {
+        stats.height = depth + 1;
+        stats.depthHistogram.resize(depth + 1);
+        stats.leafDepthHistogram.resize(depth + 1);
+    }
+
+    ++stats.depthHistogram[depth];
+    if (node->left == nullptr && node->right == nullptr)
+    {
+        ++stats.leafCount;
+        ++stats.leafDepthHistogram[depth];
+    }
+
+    T shortest = std::numeric_limits<T>::max();
+    T longest = 0;
+    for (int i = 0; i < K; ++i)
+    {
+        shortest = std::min(shortest, cellMax[i] - cellMin[i]);
+        longest = std::max(longest, cellMax[i] - cellMin[i]);
+    }
+
+    if (shortest > 0)
     {
-        pq.emplace_back(d, node);
-        std::push_heap(pq.begin(), pq.end());
+        *aspectSum += double(longest) / double(shortest);
+        ++*aspectCells;
+    }
+
+    int axis = depth % K;
+    T split = node->point[axis];
+
+    T saved = cellMax[axis];
+    cellMax[axis] = split;
+    CollectStats(node->left, cellMin, cellMax, stats, aspectSum, aspectCells, depth + 1);
+    cellMax[axis] = saved;
+
+    saved = cellMin[axis];
+    cellMin[axis] = split;
+    CollectStats(node->right, cellMin, cellMax, stats, aspectSum, aspectCells, depth + 1);
+    cellMin[axis] = saved;
+}
+
+template <int K, typename T>
+inline KDTree<K, T>::BatchQuery::BatchQuery()
+    : target{ nullptr }
+    , result{ std::span<QueryResult>{} }
+    , node{ nullptr }
+    , depth{ 0 }
+    , top{ 0 }
+{
+}
+
+template <int K, typename T>
+inline std::vector<int> KDTree<K, T>::SortTargets(std::span<const Point> targets, BatchOrder order) const
+{
+    // Curves run through the first 64 axes
+    const int dimensions = std::min(K, 64);
+    const int bits = std::min(32, 64 / dimensions);
+    const uint64_t cells = (uint64_t(1) << bits) - 1;
+
+    std::vector<std::pair<uint64_t, int>> items(targets.size());
 
-        if (pq.size() > k)
+    ParallelFor((int)targets.size(), 0, [&](int begin, int end, int) {
+        uint32_t coords[64];
+        for (int i = begin; i < end; ++i)
         {
-            std::pop_heap(pq.begin(), pq.end());
-            pq.pop_back();
+            // Coordinates are quantized within the bounding box of the tree, targets outside are clamped to it.
+            // Scaled in double, a float can't hold 32 bit cell counts and rounds past the last cell.
+            for (int axis = 0; axis < dimensions; ++axis)
+            {
+                double extent = double(upper[axis]) - double(lower[axis]);
+                double x = extent > 0 ? (double(targets[i][axis]) - double(lower[axis])) / extent : 0.0;
+                double cell = std::clamp(x, 0.0, 1.0) * double(cells);
+                coords[axis] = uint32_t(std::min(uint64_t(cell), cells));
+            }
+
+            uint64_t code = order == BatchOrder::Hilbert ? HilbertCode(coords, dimensions, bits)
+                                                         : MortonCode(coords, dimensions, bits);
+            items[i] = { code, i };
         }
+    });
+
+    RadixSort(items);
+
+    std::vector<int> indices(items.size());
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        indices[i] = items[i].second;
     }
 
-    Node* next;
-    Node* other;
+    return indices;
+}
 
-    int axis = depth % K;
-    if (target[axis] < node->point[axis])
+template <int K, typename T>
+template <typename F>
+inline void KDTree<K, T>::QueryInOrder(
+    std::span<const Point> targets, int k, std::span<QueryResult> results, BatchOrder order, F&& query) const
+{
+    assert(results.size() >= targets.size() * k);
+
+    if (order == BatchOrder::Input)
     {
-        next = node->left;
-        other = node->right;
+        query(targets, results);
+        return;
     }
-    else
+
+    std::vector<int> indices = SortTargets(targets, order);
+
+    std::vector<Point> ordered(targets.size());
+    std::vector<QueryResult> out(targets.size() * k);
+
+    ParallelFor((int)targets.size(), 0, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i)
+        {
+            ordered[i] = targets[indices[i]];
+        }
+    });
+
+    query(std::span<const Point>{ ordered }, std::span<QueryResult>{ out });
+
+    ParallelFor((int)targets.size(), 0, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i)
+        {
+            std::copy_n(&out[size_t(i) * k], k, &results[size_t(indices[i]) * k]);
+        }
+    });
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryBatch(std::span<const Point> targets, int k, std::span<QueryResult> results, int groupSize) const
+{
+    assert(root != nullptr);
+    assert(results.size() >= targets.size() * k);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+    KD_TREE_STAT(GetQueryStats().queries = targets.size());
+
+    if (groupSize <= 1)
     {
-        next = node->right;
-        other = node->left;
+        // One query after another, without the bookkeeping of interleaving
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            if (k == 1)
+            {
+                results[i] = QueryResult{ std::numeric_limits<T>::max(), nullptr };
+                QueryNearestNeighbor(root, targets[i], &results[i].node, &results[i].distance2, 0);
+                continue;
+            }
+
+            std::span<QueryResult> result = results.subspan(i * k, k);
+            std::fill(result.begin(), result.end(), QueryResult{ std::numeric_limits<T>::max(), nullptr });
+
+            KnnResultSet set{ result };
+            QueryKNearestNeighbors(root, targets[i], set, acceptAll, acceptAll, 0);
+            set.Sort();
+        }
+
+        return;
     }
 
-    QueryKNearestNeighbors(next, target, k, pq, depth + 1);
+    std::vector<BatchQuery> group(std::min(targets.size(), size_t(std::max(groupSize, 1))));
+    size_t nextTarget = 0;
 
-    T border = target[axis] - node->point[axis];
-    if (pq.size() < k || border * border < pq.front().distance2)
+    auto start = [&](BatchQuery& query) {
+        std::span<QueryResult> result = results.subspan(nextTarget * k, k);
+        std::fill(result.begin(), result.end(), QueryResult{ std::numeric_limits<T>::max(), nullptr });
+
+        query.target = &targets[nextTarget++];
+        query.result = KnnResultSet{ result };
+        query.node = root;
+        query.depth = 0;
+        query.top = 0;
+    };
+
+    for (BatchQuery& query : group)
+    {
+        start(query);
+    }
+
+    // Round-robin over the active queries, finished queries are replaced by the next target
+    size_t active = group.size();
+    while (active > 0)
     {
-        QueryKNearestNeighbors(other, target, k, pq, depth + 1);
+        for (size_t i = 0; i < active;)
+        {
+            BatchQuery& query = group[i];
+            if (StepBatchQuery(query))
+            {
+                ++i;
+                continue;
+            }
+
+            query.result.Sort();
+
+            if (nextTarget < targets.size())
+            {
+                start(query);
+                ++i;
+            }
+            else if (i != --active)
+            {
+                query = std::move(group[active]);
+            }
+        }
     }
 }
 
 template <int K, typename T>
-template <typename F>
-inline void KDTree<K, T>::QueryRadius(Node* node, const Point& target, T radius2, F* callback, int depth)
+inline bool KDTree<K, T>::StepBatchQuery(BatchQuery& query) const
 {
+    const Node* node = query.node;
+
     if (node == nullptr)
     {
-        return;
+        // Resume at the most recently deferred subtree that may hold a result, it is visited in the next round
+        while (true)
+        {
+            if (query.top == 0)
+            {
+                return false;
+            }
+
+            const DeferredNode& deferred = query.stack[--query.top];
+            if (deferred.border2 < query.result.Bound())
+            {
+                KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, true));
+                query.node = deferred.node;
+                query.depth = deferred.depth;
+                Prefetch(query.node);
+                return true;
+            }
+
+            KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, false));
+        }
     }
 
+    KD_TREE_STAT(kd_tree_stats::Visit(node, query.depth));
+
+    const Point& target = *query.target;
+
     T d = dist2(target, node->point);
-    if (d < radius2)
+    KD_TREE_STAT(++GetQueryStats().distanceEvaluations);
+    if (d < query.result.Bound())
     {
-        callback->QueryRadiusCallback(d, static_cast<const Node*>(node));
+        query.result.Insert(d, node);
     }
 
-    Node* next;
-    Node* other;
+    const Node* next;
+    const Node* other;
 
-    // Compare axis for current depth and find next branch to descend
-    int axis = depth % K;
+    int axis = query.depth % K;
     if (target[axis] < node->point[axis])
     {
         next = node->left;
@@ -367,11 +2286,227 @@ inline void KDTree<K, T>::QueryRadius(Node* node, const Point& target, T radius2
         other = node->left;
     }
 
-    QueryRadius(next, target, radius2, callback, depth + 1);
+    if (other != nullptr)
+    {
+        assert(query.top < maxStackSize);
 
-    T border = target[axis] - node->point[axis];
-    if (radius2 > border * border)
+        T border = target[axis] - node->point[axis];
+        query.stack[query.top++] = DeferredNode{ other, border * border, query.depth + 1 };
+    }
+
+    // The next node is loaded while the other queries of the group advance
+    Prefetch(next);
+    query.node = next;
+    ++query.depth;
+
+    return true;
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryPackets(std::span<const Point> targets,
+                                        int k,
+                                        std::span<QueryResult> results,
+                                        int packetSize) const
+{
+    assert(root != nullptr);
+    assert(results.size() >= targets.size() * k);
+    assert(packetSize > 0 && packetSize <= maxPacketSize);
+    KD_TREE_STAT(kd_tree_stats::BeginQuery());
+    KD_TREE_STAT(GetQueryStats().queries = targets.size());
+
+    packetSize = std::clamp(packetSize, 1, maxPacketSize);
+
+    // Coordinates of a packet by axis, so that the targets are processed in simple loops over consecutive values.
+    // Rows are padded to whole blocks.
+    int stride = (packetSize + packetBlockSize - 1) / packetBlockSize * packetBlockSize;
+    std::vector<T> coords(stride * size_t(K));
+
+    std::vector<KnnResultSet> sets;
+    sets.reserve(packetSize);
+    for (int i = 0; i < packetSize; ++i)
+    {
+        sets.emplace_back(std::span<QueryResult>{});
+    }
+
+    for (size_t first = 0; first < targets.size(); first += packetSize)
+    {
+        int count = (int)std::min(targets.size() - first, size_t(packetSize));
+
+        for (int i = 0; i < count; ++i)
+        {
+            std::span<QueryResult> result = results.subspan((first + i) * k, k);
+            std::fill(result.begin(), result.end(), QueryResult{ std::numeric_limits<T>::max(), nullptr });
+            sets[i] = KnnResultSet{ result };
+
+            for (int axis = 0; axis < K; ++axis)
+            {
+                coords[axis * stride + i] = targets[first + i][axis];
+            }
+        }
+
+        QueryPacket(&targets[first], coords.data(), stride, count, sets.data());
+
+        for (int i = 0; i < count; ++i)
+        {
+            sets[i].Sort();
+        }
+    }
+}
+
+template <int K, typename T>
+inline void KDTree<K, T>::QueryPacket(
+    const Point* targets, const T* coords, int stride, int count, KnnResultSet* results) const
+{
+    int lanes = (count + packetBlockSize - 1) / packetBlockSize * packetBlockSize;
+
+    // Padding lanes have a zero bound, so they are never closer than it
+    T bounds[maxPacketSize];
+    T values[maxPacketSize]; // Squared distances to the node
+    for (int i = 0; i < lanes; ++i)
+    {
+        bounds[i] = i < count ? results[i].Bound() : 0;
+    }
+
+    DeferredPacket stack[maxPacketStackSize];
+    int top = 0;
+
+    const Node* node = root;
+    uint64_t active = count == 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+    int depth = 0;
+
+    while (true)
     {
-        QueryRadius(other, target, radius2, callback, depth + 1);
+        while (node != nullptr)
+        {
+            // Once the packet has diverged to few targets, sharing nodes doesn't pay for processing all of them
+            if (std::popcount(active) < std::max(2, count / 4))
+            {
+                for (int i = 0; i < count; ++i)
+                {
+                    if (active >> i & 1)
+                    {
+                        QueryKNearestNeighbors(node, targets[i], results[i], acceptAll, acceptAll, depth);
+                        bounds[i] = results[i].Bound();
+                    }
+                }
+
+                break;
+            }
+
+            Prefetch(node->left);
+            Prefetch(node->right);
+
+            KD_TREE_STAT(kd_tree_stats::Visit(node, depth));
+            KD_TREE_STAT(GetQueryStats().distanceEvaluations += std::popcount(active));
+
+            // Distances are computed for all targets in blocks of fixed size, which compile to SIMD instructions.
+            // The ones of inactive targets are ignored.
+            for (int b = 0; b < lanes; b += packetBlockSize)
+            {
+                T d2[packetBlockSize] = {};
+                for (int axis = 0; axis < K; ++axis)
+                {
+                    const T* c = coords + axis * stride + b;
+                    T p = node->point[axis];
+                    for (int j = 0; j < packetBlockSize; ++j)
+                    {
+                        T d = c[j] - p;
+                        d2[j] += d * d;
+                    }
+                }
+
+                std::copy_n(d2, packetBlockSize, values + b);
+            }
+
+            uint64_t closer = 0;
+            for (int i = 0; i < lanes; ++i)
+            {
+                closer |= uint64_t(values[i] < bounds[i]) << i;
+            }
+
+            for (closer &= active; closer != 0; closer &= closer - 1)
+            {
+                int i = std::countr_zero(closer);
+                results[i].Insert(values[i], node);
+                bounds[i] = results[i].Bound();
+            }
+
+            // Side of every target and whether its bound reaches across the splitting plane
+            int axis = depth % K;
+            const T* c = coords + axis * stride;
+            T split = node->point[axis];
+
+            uint64_t left = 0;
+            uint64_t reach = 0;
+            for (int i = 0; i < lanes; ++i)
+            {
+                T border = c[i] - split;
+                left |= uint64_t(border < 0) << i;
+                reach |= uint64_t(border * border < bounds[i]) << i;
+            }
+
+            left &= active;
+            uint64_t right = active & ~left;
+            reach &= active;
+
+            // The packet follows the side most of its targets are on. If it diverges, the other targets visit their side
+            // next and the first side after it, like a single query would, so their bound is tight when they cross over.
+            bool leftFirst = std::popcount(left) >= std::popcount(right);
+            uint64_t nearFirst = leftFirst ? left : right;
+            uint64_t nearSecond = leftFirst ? right : left;
+            const Node* first = leftFirst ? node->left : node->right;
+            const Node* second = leftFirst ? node->right : node->left;
+
+            if (first != nullptr && (nearSecond & reach) != 0)
+            {
+                assert(top < maxPacketStackSize);
+                stack[top++] = DeferredPacket{ first, 0, nearSecond, split, depth + 1 };
+            }
+
+            if (second != nullptr && (nearSecond | (nearFirst & reach)) != 0)
+            {
+                assert(top < maxPacketStackSize);
+                stack[top++] = DeferredPacket{ second, nearSecond, nearFirst & reach, split, depth + 1 };
+            }
+            else
+            {
+                KD_TREE_STAT(kd_tree_stats::Branch(second, false));
+            }
+
+            active = nearFirst;
+            node = first;
+            ++depth;
+        }
+
+        // Resume at the most recently deferred subtree with targets that may have a result in it
+        while (true)
+        {
+            if (top == 0)
+            {
+                return;
+            }
+
+            const DeferredPacket& deferred = stack[--top];
+
+            const T* c = coords + (deferred.depth - 1) % K * stride;
+
+            uint64_t reach = 0;
+            for (int i = 0; i < lanes; ++i)
+            {
+                T border = c[i] - deferred.split;
+                reach |= uint64_t(border * border < bounds[i]) << i;
+            }
+
+            active = deferred.near | (deferred.far & reach);
+            if (active != 0)
+            {
+                KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, true));
+                node = deferred.node;
+                depth = deferred.depth;
+                break;
+            }
+
+            KD_TREE_STAT(kd_tree_stats::Branch(deferred.node, false));
+        }
     }
-}
\ No newline at end of file
+}
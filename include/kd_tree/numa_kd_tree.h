@@ -0,0 +1,101 @@
+#pragma once
+
+#include "kd_tree.h"
+#include "page_resource.h"
+
+#include <memory>
+#include <thread>
+
+// KD tree replicated on every NUMA node.
+// The nodes of each replica are bound to its NUMA node, so queries routed to the local replica avoid remote memory accesses.
+// Replicas are built in parallel and are queried like a KDTree, e.g. tree.Local().QueryNearestNeighbor(target).
+template <int K, typename T = float>
+class NumaReplicatedKDTree
+{
+public:
+    using Tree = KDTree<K, T>;
+    using Point = typename Tree::Point;
+
+    // Builds one replica per online NUMA node with nodes allocated using the given huge page size.
+    NumaReplicatedKDTree(const std::span<Point>& points, HugePages hugePages = HugePages::Transparent);
+
+    // Returns the replica on the NUMA node the calling thread runs on.
+    // Threads should be pinned to a node, otherwise the scheduler may move them after the call.
+    const Tree& Local() const;
+
+    // Returns the i-th replica.
+    const Tree& GetReplica(int i) const;
+
+    int GetReplicaCount() const;
+
+    // Returns the NUMA node of the i-th replica.
+    int GetReplicaNode(int i) const;
+
+private:
+    std::vector<int> numaNodes;
+    std::vector<int> replicaOfNode; // Replica index of every NUMA node id, -1 if none
+
+    // Resources are declared first, so they outlive the trees allocated from them
+    std::vector<std::unique_ptr<PageResource>> resources;
+    std::vector<std::unique_ptr<Tree>> replicas;
+};
+
+// Implementations
+
+template <int K, typename T>
+inline NumaReplicatedKDTree<K, T>::NumaReplicatedKDTree(const std::span<Point>& points, HugePages hugePages)
+    : numaNodes{ GetNumaNodes() }
+{
+    int replicaCount = (int)numaNodes.size();
+
+    replicaOfNode.assign(*std::max_element(numaNodes.begin(), numaNodes.end()) + 1, -1);
+    for (int i = 0; i < replicaCount; ++i)
+    {
+        replicaOfNode[numaNodes[i]] = i;
+        resources.push_back(std::make_unique<PageResource>(PageOptions{ hugePages, NumaPolicy::Bind, numaNodes[i] }));
+    }
+
+    replicas.resize(replicaCount);
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < replicaCount; ++i)
+    {
+        threads.emplace_back([&, i]() { replicas[i] = std::make_unique<Tree>(points, resources[i].get()); });
+    }
+
+    replicas[0] = std::make_unique<Tree>(points, resources[0].get());
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+template <int K, typename T>
+inline const typename NumaReplicatedKDTree<K, T>::Tree& NumaReplicatedKDTree<K, T>::Local() const
+{
+    int node = GetCurrentNumaNode();
+    int replica = node < (int)replicaOfNode.size() ? replicaOfNode[node] : -1;
+
+    return *replicas[replica == -1 ? 0 : replica];
+}
+
+template <int K, typename T>
+inline const typename NumaReplicatedKDTree<K, T>::Tree& NumaReplicatedKDTree<K, T>::GetReplica(int i) const
+{
+    assert(i < (int)replicas.size());
+    return *replicas[i];
+}
+
+template <int K, typename T>
+inline int NumaReplicatedKDTree<K, T>::GetReplicaCount() const
+{
+    return (int)replicas.size();
+}
+
+template <int K, typename T>
+inline int NumaReplicatedKDTree<K, T>::GetReplicaNode(int i) const
+{
+    assert(i < (int)numaNodes.size());
+    return numaNodes[i];
+}
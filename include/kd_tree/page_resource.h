@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Page size of the mappings
+enum class HugePages
+{
+    None,        // Regular pages
+    Transparent, // Regular mapping advised for transparent huge pages
+    Size2MB,     // Explicit 2MB pages from hugetlbfs, transparent huge pages if none are reserved
+    Size1GB,     // Explicit 1GB pages from hugetlbfs, transparent huge pages if none are reserved
+};
+
+// NUMA placement of the mappings
+enum class NumaPolicy
+{
+    Default,    // First touch, pages go to the node of the thread writing them first
+    Interleave, // Pages are spread round-robin over all nodes
+    Bind,       // Pages are placed on a single node
+};
+
+struct PageOptions
+{
+    HugePages hugePages = HugePages::Transparent;
+    NumaPolicy numaPolicy = NumaPolicy::Default;
+    int numaNode = 0; // Node of NumaPolicy::Bind
+};
+
+// Memory resource mapping every allocation directly from the OS with huge pages and NUMA placement.
+// Meant for few large allocations like the nodes of a tree, e.g. KDTree(points, &resource).
+// Huge pages and placement are best effort, the memory is usable either way.
+// On platforms other than Linux allocations are forwarded to the default resource.
+class PageResource : public std::pmr::memory_resource
+{
+public:
+    PageResource(PageOptions options = {});
+    ~PageResource();
+
+    PageResource(const PageResource&) = delete;
+    PageResource& operator=(const PageResource&) = delete;
+
+    const PageOptions& GetOptions() const;
+
+    // Returns the number of allocations that couldn't get explicit huge pages and used transparent ones instead.
+    size_t GetFallbackCount() const;
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+    PageOptions options;
+
+    mutable std::mutex mutex;
+    std::unordered_map<void*, size_t> mappings; // Length of every mapping
+    size_t fallbacks;
+};
+
+// Returns the ids of the online NUMA nodes, { 0 } if unknown.
+std::vector<int> GetNumaNodes();
+
+// Returns the NUMA node of the CPU the calling thread runs on, 0 if unknown.
+int GetCurrentNumaNode();
+
+// Implementations
+
+inline std::vector<int> GetNumaNodes()
+{
+    std::vector<int> nodes;
+
+#if defined(__linux__)
+    // Ranges like "0-1,4"
+    if (FILE* file = std::fopen("/sys/devices/system/node/online", "r"))
+    {
+        int first, last;
+        while (std::fscanf(file, "%d", &first) == 1)
+        {
+            last = first;
+            if (std::fscanf(file, "-%d", &last) != 1)
+            {
+                last = first;
+            }
+
+            for (int node = first; node <= last; ++node)
+            {
+                nodes.push_back(node);
+            }
+
+            if (std::fgetc(file) != ',')
+            {
+                break;
+            }
+        }
+
+        std::fclose(file);
+    }
+#endif
+
+    if (nodes.empty())
+    {
+        nodes.push_back(0);
+    }
+
+    return nodes;
+}
+
+inline int GetCurrentNumaNode()
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+    {
+        return int(node);
+    }
+#endif
+
+    return 0;
+}
+
+inline PageResource::PageResource(PageOptions options)
+    : options{ options }
+    , fallbacks{ 0 }
+{
+}
+
+inline PageResource::~PageResource()
+{
+#if defined(__linux__)
+    // Memory still allocated from the resource is released with it
+    for (auto [p, length] : mappings)
+    {
+        munmap(p, length);
+    }
+#endif
+}
+
+inline const PageOptions& PageResource::GetOptions() const
+{
+    return options;
+}
+
+inline size_t PageResource::GetFallbackCount() const
+{
+    std::lock_guard lock{ mutex };
+    return fallbacks;
+}
+
+inline void* PageResource::do_allocate(size_t bytes, [[maybe_unused]] size_t alignment)
+{
+#if defined(__linux__)
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t hugePageSize = size_t(2) << 20;
+
+    auto round = [](size_t n, size_t multiple) { return (n + multiple - 1) / multiple * multiple; };
+
+    bytes = std::max<size_t>(bytes, 1);
+    void* p = MAP_FAILED;
+    size_t length = 0;
+    bool fallback = false;
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    if (options.hugePages == HugePages::Size2MB || options.hugePages == HugePages::Size1GB)
+    {
+        int shift = options.hugePages == HugePages::Size2MB ? 21 : 30;
+
+        length = round(bytes, size_t(1) << shift);
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT);
+        p = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        fallback = p == MAP_FAILED;
+    }
+#else
+    fallback = options.hugePages == HugePages::Size2MB || options.hugePages == HugePages::Size1GB;
+#endif
+
+    if (p == MAP_FAILED)
+    {
+        // Mappings are page aligned, transparent huge pages need multiples of the huge page size
+        length = options.hugePages == HugePages::None ? round(bytes, pageSize) : round(bytes, hugePageSize);
+        p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            throw std::bad_alloc{};
+        }
+
+#if defined(MADV_HUGEPAGE)
+        if (options.hugePages != HugePages::None)
+        {
+            madvise(p, length, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    assert(alignment <= pageSize);
+
+#if defined(SYS_mbind)
+    // Placement has to be set before the pages are touched
+    if (options.numaPolicy != NumaPolicy::Default)
+    {
+        const int mpolBind = 2;
+        const int mpolInterleave = 3;
+        const int bits = 8 * sizeof(unsigned long);
+
+        std::vector<int> nodes = options.numaPolicy == NumaPolicy::Bind ? std::vector<int>{ options.numaNode } : GetNumaNodes();
+
+        std::vector<unsigned long> mask;
+        for (int node : nodes)
+        {
+            mask.resize(std::max(mask.size(), size_t(node / bits + 1)));
+            mask[node / bits] |= 1ul << (node % bits);
+        }
+
+        int mode = options.numaPolicy == NumaPolicy::Bind ? mpolBind : mpolInterleave;
+        syscall(SYS_mbind, p, length, mode, mask.data(), mask.size() * bits + 1, 0);
+    }
+#endif
+
+    std::lock_guard lock{ mutex };
+    mappings.emplace(p, length);
+    fallbacks += fallback;
+
+    return p;
+#else
+    return std::pmr::get_default_resource()->allocate(bytes, alignment);
+#endif
+}
+
+inline void PageResource::do_deallocate(void* p, [[maybe_unused]] size_t bytes, [[maybe_unused]] size_t alignment)
+{
+#if defined(__linux__)
+    size_t length;
+    {
+        std::lock_guard lock{ mutex };
+
+        auto mapping = mappings.find(p);
+        assert(mapping != mappings.end());
+
+        length = mapping->second;
+        mappings.erase(mapping);
+    }
+
+    munmap(p, length);
+#else
+    std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+#endif
+}
+
+inline bool PageResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    return this == &other;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+// Disjoint sets over [0, n) with union by size and path halving.
+class UnionFind
+{
+public:
+    UnionFind(int n);
+
+    // Returns the representative of the set containing x.
+    int Find(int x);
+
+    // Merges the sets of a and b. Returns false if they were already in the same set.
+    bool Union(int a, int b);
+
+    int GetSetCount() const;
+
+private:
+    std::vector<int> parent;
+    std::vector<int> size;
+    int setCount;
+};
+
+// Disjoint sets over [0, n) that can be merged from multiple threads concurrently.
+// Sets are linked by index, the smaller index becomes the representative.
+class ConcurrentUnionFind
+{
+public:
+    ConcurrentUnionFind(int n);
+
+    // Returns the representative of the set containing x.
+    int Find(int x);
+
+    // Merges the sets of a and b. Returns false if they were already in the same set.
+    bool Union(int a, int b);
+
+private:
+    std::unique_ptr<std::atomic<int>[]> parent;
+};
+
+// Implementations
+
+inline UnionFind::UnionFind(int n)
+    : parent(n)
+    , size(n, 1)
+    , setCount{ n }
+{
+    std::iota(parent.begin(), parent.end(), 0);
+}
+
+inline int UnionFind::Find(int x)
+{
+    while (parent[x] != x)
+    {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+
+    return x;
+}
+
+inline bool UnionFind::Union(int a, int b)
+{
+    a = Find(a);
+    b = Find(b);
+
+    if (a == b)
+    {
+        return false;
+    }
+
+    if (size[a] < size[b])
+    {
+        std::swap(a, b);
+    }
+
+    parent[b] = a;
+    size[a] += size[b];
+    --setCount;
+
+    return true;
+}
+
+inline int UnionFind::GetSetCount() const
+{
+    return setCount;
+}
+
+inline ConcurrentUnionFind::ConcurrentUnionFind(int n)
+    : parent{ new std::atomic<int>[n] }
+{
+    for (int i = 0; i < n; ++i)
+    {
+        parent[i].store(i, std::memory_order_relaxed);
+    }
+}
+
+inline int ConcurrentUnionFind::Find(int x)
+{
+    while (true)
+    {
+        int p = parent[x].load();
+        if (p == x)
+        {
+            return x;
+        }
+
+        // Path halving, losing the race only skips the shortcut
+        int gp = parent[p].load();
+        parent[x].compare_exchange_weak(p, gp);
+        x = gp;
+    }
+}
+
+inline bool ConcurrentUnionFind::Union(int a, int b)
+{
+    while (true)
+    {
+        a = Find(a);
+        b = Find(b);
+
+        if (a == b)
+        {
+            return false;
+        }
+
+        if (a < b)
+        {
+            std::swap(a, b);
+        }
+
+        // Link the larger root under the smaller one, retry if a was linked meanwhile
+        int expected = a;
+        if (parent[a].compare_exchange_strong(expected, b))
+        {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "kd_tree.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// Holds the current version of a KD tree and replaces it without blocking readers.
+// A new tree is built off to the side and published with a single atomic pointer swap.
+// Replaced versions are reclaimed with epoch based reclamation once no reader can still access them.
+template <int K, typename T = float>
+class VersionedKDTree
+{
+public:
+    using Tree = KDTree<K, T>;
+    using Point = typename Tree::Point;
+
+    // Pins the version that was current when the guard was acquired, the version stays alive until the guard is destroyed.
+    class ReadGuard
+    {
+    public:
+        ReadGuard(ReadGuard&& other);
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        ~ReadGuard();
+
+        const Tree& operator*() const;
+        const Tree* operator->() const;
+        const Tree* Get() const;
+
+    private:
+        friend class VersionedKDTree;
+
+        ReadGuard(std::atomic<uint64_t>* slot, const Tree* tree);
+
+        std::atomic<uint64_t>* slot;
+        const Tree* tree;
+    };
+
+    // maxReaders is the number of guards that can be held at the same time.
+    VersionedKDTree(int maxReaders = 256);
+    VersionedKDTree(const std::span<Point>& points, int maxReaders = 256);
+    ~VersionedKDTree();
+
+    // Returns a guard to the current version. Lock-free unless maxReaders guards are already held.
+    ReadGuard Acquire() const;
+
+    // Builds a new tree from given points and publishes it. Readers keep using the previous version meanwhile.
+    void Rebuild(const std::span<Point>& points);
+
+    // Replaces the current version with the given tree.
+    void Publish(std::unique_ptr<Tree> tree);
+
+    // Deletes replaced versions no reader can access anymore.
+    // Returns the number of versions deleted.
+    size_t Reclaim();
+
+    // Returns the number of published versions.
+    uint64_t GetVersion() const;
+
+    // Returns the number of replaced versions waiting to be reclaimed.
+    size_t GetRetiredCount() const;
+
+private:
+    // Epoch announced by a reader, 0 if the slot is free
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch{ 0 };
+    };
+
+    struct Retired
+    {
+        std::unique_ptr<Tree> tree;
+        uint64_t epoch; // Readers that announced this epoch or later can't see the tree
+    };
+
+    size_t ReclaimRetired();
+
+    std::unique_ptr<Slot[]> slots;
+    int slotCount;
+
+    std::atomic<const Tree*> current;
+    std::atomic<uint64_t> epoch;
+
+    // Serializes writers
+    mutable std::mutex writeMutex;
+    std::vector<Retired> retired;
+    uint64_t version;
+};
+
+// Implementations
+
+template <int K, typename T>
+inline VersionedKDTree<K, T>::ReadGuard::ReadGuard(std::atomic<uint64_t>* slot, const Tree* tree)
+    : slot{ slot }
+    , tree{ tree }
+{
+}
+
+template <int K, typename T>
+inline VersionedKDTree<K, T>::ReadGuard::ReadGuard(ReadGuard&& other)
+    : slot{ std::exchange(other.slot, nullptr) }
+    , tree{ std::exchange(other.tree, nullptr) }
+{
+}
+
+template <int K, typename T>
+inline VersionedKDTree<K, T>::ReadGuard::~ReadGuard()
+{
+    if (slot != nullptr)
+    {
+        slot->store(0, std::memory_order_release);
+    }
+}
+
+template <int K, typename T>
+inline const typename VersionedKDTree<K, T>::Tree& VersionedKDTree<K, T>::ReadGuard::operator*() const
+{
+    assert(tree != nullptr);
+    return *tree;
+}
+
+template <int K, typename T>
+inline const typename VersionedKDTree<K, T>::Tree* VersionedKDTree<K, T>::ReadGuard::operator->() const
+{
+    assert(tree != nullptr);
+    return tree;
+}
+
+template <int K, typename T>
+inline const typename VersionedKDTree<K, T>::Tree* VersionedKDTree<K, T>::ReadGuard::Get() const
+{
+    return tree;
+}
+
+template <int K, typename T>
+inline VersionedKDTree<K, T>::VersionedKDTree(int maxReaders)
+    : slots{ new Slot[maxReaders] }
+    , slotCount{ maxReaders }
+    , current{ nullptr }
+    , epoch{ 1 }
+    , version{ 0 }
+{
+    assert(maxReaders > 0);
+}
+
+template <int K, typename T>
+inline VersionedKDTree<K, T>::VersionedKDTree(const std::span<Point>& points, int maxReaders)
+    : VersionedKDTree(maxReaders)
+{
+    Rebuild(points);
+}
+
+template <int K, typename T>
+inline VersionedKDTree<K, T>::~VersionedKDTree()
+{
+    for (int i = 0; i < slotCount; ++i)
+    {
+        assert(slots[i].epoch.load() == 0 && "All read guards must be released before destruction");
+    }
+
+    delete current.load();
+}
+
+template <int K, typename T>
+inline typename VersionedKDTree<K, T>::ReadGuard VersionedKDTree<K, T>::Acquire() const
+{
+    // Spread threads over the slots to avoid contention on the first ones
+    static thread_local int hint = int(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+    // Slots are indexed in unsigned arithmetic, so hints near INT_MAX and long spins wrap around instead of overflowing
+    for (unsigned i = 0;; ++i)
+    {
+        std::atomic<uint64_t>& slot = slots[(unsigned(hint) + i) % unsigned(slotCount)].epoch;
+
+        // Announcing an outdated epoch is safe, it only delays reclamation
+        uint64_t e = epoch.load();
+        uint64_t expected = 0;
+        if (slot.load(std::memory_order_relaxed) == 0 && slot.compare_exchange_strong(expected, e))
+        {
+            // The announcement is ordered before this load, so a writer either sees it or this load sees the new version
+            return ReadGuard{ &slot, current.load() };
+        }
+
+        if (i > 0 && i % unsigned(slotCount) == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+template <int K, typename T>
+inline void VersionedKDTree<K, T>::Rebuild(const std::span<Point>& points)
+{
+    // Build outside of the lock, only publishing is serialized
+    Publish(std::make_unique<Tree>(points));
+}
+
+template <int K, typename T>
+inline void VersionedKDTree<K, T>::Publish(std::unique_ptr<Tree> tree)
+{
+    std::lock_guard lock{ writeMutex };
+
+    const Tree* old = current.exchange(tree.release());
+    uint64_t e = epoch.fetch_add(1) + 1;
+    ++version;
+
+    if (old != nullptr)
+    {
+        retired.push_back(Retired{ std::unique_ptr<Tree>(const_cast<Tree*>(old)), e });
+    }
+
+    ReclaimRetired();
+}
+
+template <int K, typename T>
+inline size_t VersionedKDTree<K, T>::Reclaim()
+{
+    std::lock_guard lock{ writeMutex };
+
+    return ReclaimRetired();
+}
+
+template <int K, typename T>
+inline uint64_t VersionedKDTree<K, T>::GetVersion() const
+{
+    std::lock_guard lock{ writeMutex };
+
+    return version;
+}
+
+template <int K, typename T>
+inline size_t VersionedKDTree<K, T>::GetRetiredCount() const
+{
+    std::lock_guard lock{ writeMutex };
+
+    return retired.size();
+}
+
+template <int K, typename T>
+inline size_t VersionedKDTree<K, T>::ReclaimRetired()
+{
+    // Oldest epoch any active reader announced
+    uint64_t minEpoch = std::numeric_limits<uint64_t>::max();
+    for (int i = 0; i < slotCount; ++i)
+    {
+        uint64_t e = slots[i].epoch.load();
+        if (e != 0)
+        {
+            minEpoch = std::min(minEpoch, e);
+        }
+    }
+
+    size_t count = retired.size();
+    std::erase_if(retired, [&](const Retired& r) { return r.epoch <= minEpoch; });
+
+    return count - retired.size();
+}
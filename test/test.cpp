@@ -1,10 +1,20 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
+#include "kd_tree/dbscan.h"
+#include "kd_tree/dual_tree.h"
+#include "kd_tree/dynamic_kd_tree.h"
+#include "kd_tree/emst.h"
 #include "kd_tree/kd_tree.h"
+#include "kd_tree/numa_kd_tree.h"
+#include "kd_tree/page_resource.h"
+#include "kd_tree/versioned_kd_tree.h"
 #include "timer.h"
 
+#include <atomic>
+#include <memory_resource>
 #include <random>
+#include <thread>
 #include <vector>
 
 inline std::minstd_rand prng;
@@ -204,4 +214,1476 @@ TEST_CASE("K-Nearest neighbor query")
         std::pop_heap(v.begin(), v.end());
         v.pop_back();
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE("Dynamic dimension queries")
+{
+    int count = 20000;
+
+    // Specialized kernels (2, 16) and the generic one (5)
+    for (int dim : { 2, 5, 16 })
+    {
+        std::vector<float> coords(count * dim);
+        for (float& c : coords)
+        {
+            c = Prand(-10000, 10000);
+        }
+
+        DynamicKDTree<float> tree(dim, coords);
+        REQUIRE_EQ(tree.GetDimension(), dim);
+
+        std::vector<float> target(dim);
+        for (float& c : target)
+        {
+            c = Prand(-10000, 10000);
+        }
+
+        // Brute force
+        std::vector<float> bd(count);
+        for (int i = 0; i < count; ++i)
+        {
+            bd[i] = tree.dist2(target.data(), coords.data() + i * dim);
+        }
+
+        auto nn = tree.QueryNearestNeighbor(target.data());
+        REQUIRE_EQ(nn.distance2, *std::min_element(bd.begin(), bd.end()));
+        REQUIRE_EQ(bd[nn.node->index], nn.distance2);
+
+        int k = 10;
+        auto v = tree.QueryKNearestNeighbors(target.data(), k);
+        REQUIRE_EQ(v.size(), k);
+
+        std::vector<float> sorted = bd;
+        std::nth_element(sorted.begin(), sorted.begin() + k - 1, sorted.end());
+        REQUIRE_EQ(v.front().distance2, sorted[k - 1]);
+
+        float radius = std::sqrt(sorted[k - 1]) + 1.0f;
+
+        struct TempCallback
+        {
+            void QueryRadiusCallback(float distance2, const DynamicKDTree<float>::Node* node)
+            {
+                ++count;
+            }
+
+            int count;
+        } callback;
+
+        callback.count = 0;
+        tree.QueryRadius(target.data(), radius, &callback);
+
+        int bfCount = (int)std::count_if(bd.begin(), bd.end(), [&](float d) { return d < radius * radius; });
+        REQUIRE_EQ(callback.count, bfCount);
+    }
+}
+
+TEST_CASE("Dynamic dimension stride")
+{
+    int count = 20000;
+    int dim = 3;
+    int stride = 5;
+
+    using point = KDTree<3>::Point;
+
+    // Interleaved positions and two other attributes, the last point is not padded to a full stride
+    std::vector<float> coords((count - 1) * stride + dim);
+    std::vector<point> points(count);
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j = 0; j < stride && i * stride + j < (int)coords.size(); ++j)
+        {
+            coords[i * stride + j] = Prand(-10000, 10000);
+        }
+
+        points[i] = point{ coords[i * stride], coords[i * stride + 1], coords[i * stride + 2] };
+    }
+
+    DynamicKDTree<float> tree(dim, coords, stride);
+    KDTree<3> reference(points);
+
+    int k = 10;
+    for (int i = 0; i < 100; ++i)
+    {
+        std::vector<float> target(dim);
+        for (float& c : target)
+        {
+            c = Prand(-10000, 10000);
+        }
+
+        point p{ target[0], target[1], target[2] };
+
+        auto nn = tree.QueryNearestNeighbor(target.data());
+        auto expected = reference.QueryNearestNeighbor(p);
+        REQUIRE_EQ(nn.distance2, expected.distance2);
+        REQUIRE_EQ(nn.node->index, expected.node->index);
+
+        auto v = tree.QueryKNearestNeighbors(target.data(), k);
+        auto w = reference.QueryKNearestNeighbors(p, k);
+        REQUIRE_EQ(v.size(), w.size());
+
+        std::sort_heap(v.begin(), v.end());
+        std::sort_heap(w.begin(), w.end());
+        for (int j = 0; j < k; ++j)
+        {
+            REQUIRE_EQ(v[j].distance2, w[j].distance2);
+        }
+    }
+}
+
+TEST_CASE("Box query")
+{
+    int count = 1000000;
+
+    using point = KDTree<2>::Point;
+    using node = KDTree<2>::Node;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    // Build KD-tree
+    KDTree<2> tree(points);
+
+    point min{ Prand(-10000, 8000), Prand(-10000, 8000) };
+    point max{ min[0] + 2000, min[1] + 1000 };
+
+    auto inside = [&](const point& p) { return min[0] <= p[0] && p[0] <= max[0] && min[1] <= p[1] && p[1] <= max[1]; };
+
+    Timer timer;
+
+    // Brute force
+    int bfCount = (int)std::count_if(points.begin(), points.end(), inside);
+
+    timer.Mark();
+
+    std::vector<const node*> result;
+    tree.QueryBox(min, max, std::back_inserter(result));
+
+    timer.Mark();
+
+    REQUIRE_EQ(result.size(), bfCount);
+    REQUIRE_EQ(std::all_of(result.begin(), result.end(), [&](const node* n) { return inside(n->point); }), true);
+
+    // The whole tree is reported for a box covering every point
+    result.clear();
+    point all_min{ -10000, -10000 };
+    point all_max{ 10000, 10000 };
+    tree.QueryBox(all_min, all_max, std::back_inserter(result));
+    REQUIRE_EQ(result.size(), count);
+
+    std::cout << "\n----------------------\n" << std::endl;
+    std::cout << "Box query" << std::endl;
+    std::cout << "Number of points: " << count << std::endl;
+    std::cout << "BF query\t: " << timer.Get() * 1000 << "ms" << std::endl;
+    std::cout << "Kd-tree query\t: " << timer.Get() * 1000 << "ms" << std::endl;
+}
+
+TEST_CASE("Counting query")
+{
+    int count = 1000000;
+
+    using point = KDTree<2>::Point;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    // Build KD-tree
+    KDTree<2> tree(points);
+
+    point target{ Prand(-10000, 10000), Prand(-10000, 10000) };
+    float radius = 500.0;
+
+    point min{ Prand(-10000, 8000), Prand(-10000, 8000) };
+    point max{ min[0] + 2000, min[1] + 1000 };
+
+    // Brute force
+    int bfRadius = 0;
+    int bfBox = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (tree.dist2(target, points[i]) < radius * radius)
+        {
+            ++bfRadius;
+        }
+
+        if (min[0] <= points[i][0] && points[i][0] <= max[0] && min[1] <= points[i][1] && points[i][1] <= max[1])
+        {
+            ++bfBox;
+        }
+    }
+
+    Timer timer;
+
+    int radiusCount = tree.CountRadius(target, radius);
+
+    timer.Mark();
+
+    int boxCount = tree.CountBox(min, max);
+
+    timer.Mark();
+
+    REQUIRE_EQ(radiusCount, bfRadius);
+    REQUIRE_EQ(boxCount, bfBox);
+    REQUIRE_EQ(tree.CountBox(point{ -10000, -10000 }, point{ 10000, 10000 }), count);
+
+    REQUIRE_EQ(tree.CountRadiusAtLeast(target, radius, bfRadius), true);
+    REQUIRE_EQ(tree.CountRadiusAtLeast(target, radius, bfRadius + 1), false);
+    REQUIRE_EQ(tree.CountBoxAtLeast(min, max, bfBox), true);
+    REQUIRE_EQ(tree.CountBoxAtLeast(min, max, bfBox + 1), false);
+
+    std::cout << "\n----------------------\n" << std::endl;
+    std::cout << "Counting query" << std::endl;
+    std::cout << "Number of points: " << count << std::endl;
+    std::cout << "Kd-tree radius count\t: " << timer.Get() * 1000 << "ms" << std::endl;
+    std::cout << "Kd-tree box count\t: " << timer.Get() * 1000 << "ms" << std::endl;
+}
+
+TEST_CASE("Radius query control")
+{
+    int count = 100000;
+
+    using point = KDTree<2>::Point;
+    using node = KDTree<2>::Node;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    KDTree<2> tree(points);
+
+    point target{ Prand(-10000, 10000), Prand(-10000, 10000) };
+    float radius = 500.0;
+
+    // Lambda without return value visits every point in the radius
+    int all = 0;
+    tree.QueryRadius(target, radius, [&](float distance2, const node* n) { ++all; });
+    REQUIRE_EQ(all, tree.CountRadius(target, radius));
+    REQUIRE_GT(all, 1);
+
+    // Find any point within the radius
+    int visited = 0;
+    tree.QueryRadius(target, radius, [&](float distance2, const node* n) {
+        ++visited;
+        return QueryControl::Stop;
+    });
+    REQUIRE_EQ(visited, 1);
+
+    // Shrinking the radius to every reported point ends with the nearest neighbor
+    const node* nearest = nullptr;
+    float nearestDistance2 = 0;
+    tree.QueryRadius(target, radius, [&](float distance2, const node* n) {
+        nearest = n;
+        nearestDistance2 = distance2;
+        return QueryControl::Shrink;
+    });
+    REQUIRE_EQ(nearestDistance2, tree.QueryNearestNeighbor(target).distance2);
+    REQUIRE_EQ(nearest, tree.QueryNearestNeighbor(target).node);
+}
+
+TEST_CASE("Radius query into buffer")
+{
+    int count = 100000;
+
+    using point = KDTree<2>::Point;
+    using result = KDTree<2>::QueryResult;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    KDTree<2> tree(points);
+
+    point target{ Prand(-10000, 10000), Prand(-10000, 10000) };
+    float radius = 500.0;
+
+    std::vector<result> v;
+    tree.QueryRadius(target, radius, v, true);
+
+    REQUIRE_EQ(v.size(), tree.CountRadius(target, radius));
+    REQUIRE_EQ(std::is_sorted(v.begin(), v.end()), true);
+
+    // Capped results are the nearest ones
+    size_t maxResults = v.size() / 2;
+    std::vector<result> capped;
+    tree.QueryRadius(target, radius, capped, true, maxResults);
+
+    REQUIRE_EQ(capped.size(), maxResults);
+    for (size_t i = 0; i < maxResults; ++i)
+    {
+        REQUIRE_EQ(capped[i].distance2, v[i].distance2);
+    }
+
+    // The buffer capacity is reused across queries
+    size_t capacity = v.capacity();
+    const result* data = v.data();
+    tree.QueryRadius(target, radius / 2, v);
+    REQUIRE_EQ(v.capacity(), capacity);
+    REQUIRE_EQ(v.data(), data);
+    REQUIRE_EQ(v.size(), tree.CountRadius(target, radius / 2));
+}
+
+TEST_CASE("K-Nearest neighbor query into result set")
+{
+    int count = 100000;
+
+    using point = KDTree<2>::Point;
+    using result = KDTree<2>::QueryResult;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    KDTree<2> tree(points);
+
+    // Insertion-sorted array and heap backed sets
+    for (int k : { 1, 10, 100 })
+    {
+        KDTree<2>::KnnResultSet set(k);
+
+        for (int q = 0; q < 10; ++q)
+        {
+            point target{ Prand(-10000, 10000), Prand(-10000, 10000) };
+
+            // Reference result from the max-heap query
+            auto v = tree.QueryKNearestNeighbors(target, k);
+            std::sort_heap(v.begin(), v.end());
+
+            tree.QueryKNearestNeighbors(target, set);
+            REQUIRE_EQ(set.Size(), k);
+
+            std::vector<result> buffer(k);
+            REQUIRE_EQ(tree.QueryKNearestNeighbors(target, buffer), k);
+
+            for (int i = 0; i < k; ++i)
+            {
+                REQUIRE_EQ(set[i].distance2, v[i].distance2);
+                REQUIRE_EQ(buffer[i].distance2, v[i].distance2);
+            }
+        }
+    }
+
+    // Fewer points than k
+    std::vector<point> few(points.begin(), points.begin() + 5);
+    KDTree<2> small(few);
+    KDTree<2>::KnnResultSet set(10);
+    small.QueryKNearestNeighbors(few[0], set);
+    REQUIRE_EQ(set.Size(), 5);
+    REQUIRE_EQ(set[0].distance2, 0);
+    REQUIRE_EQ(std::is_sorted(set.Results().begin(), set.Results().end()), true);
+}
+
+TEST_CASE("Concurrent queries")
+{
+    int count = 200000;
+    int queryCount = 2000;
+    int threadCount = 8;
+
+    using point = KDTree<2>::Point;
+    using node = KDTree<2>::Node;
+    using result = KDTree<2>::QueryResult;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    const KDTree<2> tree(points);
+
+    std::vector<point> targets(queryCount);
+    for (point& p : targets)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    int k = 8;
+    float radius = 300.0;
+
+    // Expected results computed on a single thread
+    std::vector<const node*> nn(queryCount);
+    std::vector<float> knn(queryCount);
+    std::vector<int> radiusCount(queryCount);
+    std::vector<int> boxCount(queryCount);
+
+    for (int i = 0; i < queryCount; ++i)
+    {
+        point min{ targets[i][0] - radius, targets[i][1] - radius };
+        point max{ targets[i][0] + radius, targets[i][1] + radius };
+
+        nn[i] = tree.QueryNearestNeighbor(targets[i]).node;
+        knn[i] = tree.QueryKNearestNeighbors(targets[i], k).front().distance2;
+        radiusCount[i] = tree.CountRadius(targets[i], radius);
+        boxCount[i] = tree.CountBox(min, max);
+    }
+
+    // Every thread runs mixed queries against the shared tree in a different order
+    std::atomic<int> mismatches = 0;
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            KDTree<2>::KnnResultSet set(k);
+            std::vector<result> buffer;
+            std::vector<const node*> boxResult;
+
+            for (int j = 0; j < queryCount; ++j)
+            {
+                int i = (j * (t + 1) + t) % queryCount;
+                const point& target = targets[i];
+                point min{ target[0] - radius, target[1] - radius };
+                point max{ target[0] + radius, target[1] + radius };
+
+                bool ok = true;
+
+                switch ((i + t) % 4)
+                {
+                case 0:
+                    ok = tree.QueryNearestNeighbor(target).node == nn[i];
+                    break;
+                case 1:
+                    tree.QueryKNearestNeighbors(target, set);
+                    ok = set[k - 1].distance2 == knn[i];
+                    break;
+                case 2:
+                    tree.QueryRadius(target, radius, buffer, true);
+                    ok = buffer.size() == radiusCount[i];
+                    break;
+                case 3:
+                    boxResult.clear();
+                    tree.QueryBox(min, max, std::back_inserter(boxResult));
+                    ok = boxResult.size() == boxCount[i] && tree.CountBox(min, max) == boxCount[i];
+                    break;
+                }
+
+                if (!ok)
+                {
+                    ++mismatches;
+                }
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    REQUIRE_EQ(mismatches.load(), 0);
+}
+
+TEST_CASE("Versioned tree rebuild")
+{
+    int count = 20000;
+    int rebuildCount = 20;
+    int threadCount = 4;
+
+    using point = KDTree<2>::Point;
+
+    // Every point of a version is tagged with the version number
+    auto generate = [&](uintptr_t version) {
+        std::vector<point> points(count);
+        for (point& p : points)
+        {
+            p = point{ Prand(-10000, 10000), Prand(-10000, 10000) };
+            p.userData = reinterpret_cast<void*>(version);
+        }
+
+        return points;
+    };
+
+    std::vector<point> points = generate(1);
+    VersionedKDTree<2> tree(points);
+
+    std::atomic<bool> done = false;
+    std::atomic<int> mismatches = 0;
+    std::atomic<int> queries = 0;
+    std::vector<std::thread> readers;
+
+    for (int t = 0; t < threadCount; ++t)
+    {
+        readers.emplace_back([&]() {
+            point target{ 0, 0 };
+
+            while (!done)
+            {
+                auto guard = tree.Acquire();
+
+                // All results come from the single version pinned by the guard
+                void* tag = guard->GetRootNode()->point.userData;
+                auto v = guard->QueryKNearestNeighbors(target, 16);
+                for (auto& r : v)
+                {
+                    if (r.node->point.userData != tag)
+                    {
+                        ++mismatches;
+                    }
+                }
+
+                ++queries;
+            }
+        });
+    }
+
+    for (int i = 2; i <= rebuildCount + 1; ++i)
+    {
+        std::vector<point> next = generate(i);
+        tree.Rebuild(next);
+    }
+
+    done = true;
+    for (std::thread& thread : readers)
+    {
+        thread.join();
+    }
+
+    REQUIRE_EQ(mismatches.load(), 0);
+    REQUIRE_EQ(tree.GetVersion(), rebuildCount + 1);
+
+    // Nothing can hold old versions anymore
+    tree.Reclaim();
+    REQUIRE_EQ(tree.GetRetiredCount(), 0);
+
+    // A held guard keeps its version alive across a rebuild
+    {
+        auto guard = tree.Acquire();
+        std::vector<point> next = generate(0);
+        tree.Rebuild(next);
+
+        REQUIRE_EQ(tree.GetRetiredCount(), 1);
+        REQUIRE_EQ(guard->GetRootNode()->point.userData, reinterpret_cast<void*>(uintptr_t(rebuildCount + 1)));
+    }
+
+    REQUIRE_EQ(tree.Reclaim(), 1);
+    REQUIRE_EQ(tree.Acquire()->GetRootNode()->point.userData, nullptr);
+}
+
+TEST_CASE("All K-Nearest neighbors")
+{
+    int count = 5000;
+    int k = 6;
+
+    using point = KDTree<2>::Point;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    KDTree<2> tree(points);
+
+    std::vector<int> indices(count * k);
+    std::vector<float> distances2(count * k);
+
+    Timer timer;
+
+    tree.AllKNearestNeighbors(k, indices, distances2, 4);
+
+    timer.Mark();
+
+    // Brute force
+    std::vector<float> d(count);
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j = 0; j < count; ++j)
+        {
+            d[j] = j == i ? FLT_MAX : tree.dist2(points[i], points[j]);
+        }
+
+        std::partial_sort(d.begin(), d.begin() + k, d.end());
+
+        for (int j = 0; j < k; ++j)
+        {
+            REQUIRE_NE(indices[i * k + j], i);
+            REQUIRE_EQ(distances2[i * k + j], d[j]);
+            REQUIRE_EQ(tree.dist2(points[i], points[indices[i * k + j]]), d[j]);
+        }
+    }
+
+    timer.Mark();
+
+    // More neighbors requested than available
+    std::vector<point> few(points.begin(), points.begin() + 4);
+    KDTree<2> small(few);
+    std::vector<int> fewIndices(4 * k);
+    std::vector<float> fewDistances2(4 * k);
+    small.AllKNearestNeighbors(k, fewIndices, fewDistances2);
+    REQUIRE_NE(fewIndices[2], -1);
+    REQUIRE_EQ(fewIndices[3], -1);
+
+    std::cout << "\n----------------------\n" << std::endl;
+    std::cout << "All K-Nearest neighbors" << std::endl;
+    std::cout << "Number of points: " << count << std::endl;
+    std::cout << "Kd-tree query\t: " << timer.Get() * 1000 << "ms" << std::endl;
+    std::cout << "BF query\t: " << timer.Get() * 1000 << "ms" << std::endl;
+}
+
+TEST_CASE("Dual tree joins")
+{
+    int queryCount = 3000;
+    int refCount = 5000;
+    int k = 4;
+
+    using point = KDTree<2>::Point;
+    using node = KDTree<2>::Node;
+
+    std::vector<point> queries(queryCount);
+    std::vector<point> refs(refCount);
+
+    for (point& p : queries)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    for (point& p : refs)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    KDTree<2> queryTree(queries);
+    KDTree<2> refTree(refs);
+
+    std::vector<int> indices(queryCount * k);
+    std::vector<float> distances2(queryCount * k);
+
+    Timer timer;
+
+    KnnJoin(queryTree, refTree, k, indices, distances2);
+
+    timer.Mark();
+
+    std::vector<float> d(refCount);
+    for (int i = 0; i < queryCount; ++i)
+    {
+        for (int j = 0; j < refCount; ++j)
+        {
+            d[j] = KDTree<2>::dist2(queries[i], refs[j]);
+        }
+
+        std::partial_sort(d.begin(), d.begin() + k, d.end());
+
+        for (int j = 0; j < k; ++j)
+        {
+            REQUIRE_EQ(distances2[i * k + j], d[j]);
+            REQUIRE_EQ(KDTree<2>::dist2(queries[i], refs[indices[i * k + j]]), d[j]);
+        }
+    }
+
+    float radius = 200.0;
+    int pairCount = 0;
+
+    timer.Mark();
+
+    RangeJoin(queryTree, refTree, radius, [&](const node* a, const node* b, float distance2) {
+        REQUIRE_EQ(distance2, KDTree<2>::dist2(a->point, b->point));
+        ++pairCount;
+    });
+
+    timer.Mark();
+
+    int bfCount = 0;
+    for (int i = 0; i < queryCount; ++i)
+    {
+        bfCount += refTree.CountRadius(queries[i], radius);
+    }
+
+    REQUIRE_EQ(pairCount, bfCount);
+
+    std::cout << "\n----------------------\n" << std::endl;
+    std::cout << "Dual tree joins" << std::endl;
+    std::cout << "Number of points: " << queryCount << " x " << refCount << std::endl;
+    std::cout << "Kd-tree knn join\t: " << timer.Get() * 1000 << "ms" << std::endl;
+    timer.Get();
+    std::cout << "Kd-tree range join\t: " << timer.Get() * 1000 << "ms" << std::endl;
+}
+
+TEST_CASE("All pairs within radius")
+{
+    int count = 20000;
+
+    using point = KDTree<2>::Point;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    KDTree<2> tree(points);
+
+    float radius = 150.0;
+
+    KDTree<2>::NeighborList full;
+    KDTree<2>::NeighborList unique;
+
+    tree.AllPairsWithinRadius(radius, full, false, 4);
+    tree.AllPairsWithinRadius(radius, unique, true, 4);
+
+    REQUIRE_EQ(full.offsets.size(), count + 1);
+    REQUIRE_EQ(unique.offsets.size(), count + 1);
+
+    int pairCount = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        // Every point finds itself once with CountRadius
+        int expected = tree.CountRadius(points[i], radius) - 1;
+        REQUIRE_EQ(full.offsets[i + 1] - full.offsets[i], expected);
+        pairCount += expected;
+
+        for (int j = full.offsets[i]; j < full.offsets[i + 1]; ++j)
+        {
+            REQUIRE_NE(full.indices[j], i);
+            REQUIRE_LT(tree.dist2(points[i], points[full.indices[j]]), radius * radius);
+        }
+
+        for (int j = unique.offsets[i]; j < unique.offsets[i + 1]; ++j)
+        {
+            REQUIRE_GT(unique.indices[j], i);
+        }
+    }
+
+    REQUIRE_EQ(full.indices.size(), pairCount);
+    REQUIRE_EQ(unique.indices.size() * 2, pairCount);
+}
+
+TEST_CASE("Euclidean minimum spanning tree")
+{
+    int count = 3000;
+
+    using point = KDTree<2>::Point;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        // Two separated groups
+        float offset = i < count / 2 ? -20000 : 20000;
+        points[i][0] = Prand(-10000, 10000) + offset;
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    KDTree<2> tree(points);
+
+    Timer timer;
+
+    auto edges = ComputeEMST(tree);
+
+    timer.Mark();
+
+    REQUIRE_EQ(edges.size(), count - 1);
+
+    // Prim's algorithm as reference
+    std::vector<float> best(count, FLT_MAX);
+    std::vector<bool> used(count, false);
+    double expected = 0;
+    best[0] = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        int next = -1;
+        for (int j = 0; j < count; ++j)
+        {
+            if (!used[j] && (next == -1 || best[j] < best[next]))
+            {
+                next = j;
+            }
+        }
+
+        used[next] = true;
+        expected += std::sqrt(best[next]);
+
+        for (int j = 0; j < count; ++j)
+        {
+            best[j] = std::min(best[j], tree.dist2(points[next], points[j]));
+        }
+    }
+
+    timer.Mark();
+
+    double total = 0;
+    UnionFind connected{ count };
+    for (const auto& e : edges)
+    {
+        REQUIRE_EQ(e.distance2, tree.dist2(points[e.a], points[e.b]));
+        REQUIRE(connected.Union(e.a, e.b));
+        total += std::sqrt(e.distance2);
+    }
+
+    REQUIRE_EQ(total, doctest::Approx(expected).epsilon(1e-6));
+
+    // Cutting the edge between the groups leaves two clusters
+    auto labels = SingleLinkageClusters<float>(edges, count, 5000);
+    REQUIRE_EQ(*std::max_element(labels.begin(), labels.end()), 1);
+    REQUIRE_EQ(labels[0], 0);
+    REQUIRE_EQ(labels[count - 1], 1);
+
+    std::cout << "\n----------------------\n" << std::endl;
+    std::cout << "Euclidean minimum spanning tree" << std::endl;
+    std::cout << "Number of points: " << count << std::endl;
+    std::cout << "Kd-tree Boruvka\t: " << timer.Get() * 1000 << "ms" << std::endl;
+    std::cout << "BF Prim\t\t: " << timer.Get() * 1000 << "ms" << std::endl;
+}
+
+TEST_CASE("DBSCAN")
+{
+    int count = 4000;
+    int minPts = 8;
+    float eps = 300;
+
+    using point = KDTree<2>::Point;
+
+    // Dense blobs over sparse noise
+    std::vector<point> points(count);
+    std::normal_distribution<float> normal(0, 800);
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (i % 4 == 0)
+        {
+            points[i] = point{ Prand(-10000, 10000), Prand(-10000, 10000) };
+        }
+        else
+        {
+            float cx = (i % 3 - 1) * 6000.0f;
+            points[i] = point{ cx + normal(prng), normal(prng) };
+        }
+    }
+
+    KDTree<2> tree(points);
+
+    Timer timer;
+
+    auto labels = DBSCAN(tree, eps, minPts, 4);
+
+    timer.Mark();
+
+    // Brute force neighborhoods
+    std::vector<std::vector<int>> neighbors(count);
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j = 0; j < count; ++j)
+        {
+            if (tree.dist2(points[i], points[j]) < eps * eps)
+            {
+                neighbors[i].push_back(j);
+            }
+        }
+    }
+
+    auto isCore = [&](int i) { return (int)neighbors[i].size() >= minPts; };
+
+    for (int i = 0; i < count; ++i)
+    {
+        bool reachable = isCore(i) || std::any_of(neighbors[i].begin(), neighbors[i].end(), isCore);
+        REQUIRE_EQ(labels[i] != -1, reachable);
+
+        for (int j : neighbors[i])
+        {
+            // Core neighbors share a cluster, border points belong to the cluster of a core neighbor
+            if (isCore(i) && isCore(j))
+            {
+                REQUIRE_EQ(labels[i], labels[j]);
+            }
+        }
+
+        if (!isCore(i) && reachable)
+        {
+            REQUIRE(std::any_of(neighbors[i].begin(), neighbors[i].end(),
+                                [&](int j) { return isCore(j) && labels[j] == labels[i]; }));
+        }
+    }
+
+    // Clusters are only connected through core points
+    UnionFind clusters{ count };
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j : neighbors[i])
+        {
+            if (isCore(i) && isCore(j))
+            {
+                clusters.Union(i, j);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j = 0; j < count; j += 97)
+        {
+            if (isCore(i) && isCore(j))
+            {
+                REQUIRE_EQ(labels[i] == labels[j], clusters.Find(i) == clusters.Find(j));
+            }
+        }
+    }
+
+    // Core distances
+    auto core2 = CoreDistances2(tree, minPts);
+    for (int i = 0; i < count; i += 13)
+    {
+        std::vector<float> d(count);
+        for (int j = 0; j < count; ++j)
+        {
+            d[j] = tree.dist2(points[i], points[j]);
+        }
+
+        std::nth_element(d.begin(), d.begin() + minPts - 1, d.end());
+        REQUIRE_EQ(core2[i], d[minPts - 1]);
+    }
+
+    std::cout << "\n----------------------\n" << std::endl;
+    std::cout << "DBSCAN" << std::endl;
+    std::cout << "Number of points: " << count << std::endl;
+    std::cout << "Number of clusters: " << *std::max_element(labels.begin(), labels.end()) + 1 << std::endl;
+    std::cout << "Kd-tree DBSCAN\t: " << timer.Get() * 1000 << "ms" << std::endl;
+}
+
+TEST_CASE("Filtered nearest neighbor query")
+{
+    int count = 100000;
+
+    using point = KDTree<2>::Point;
+    using node = KDTree<2>::Node;
+
+    // Category index stored in user data, category 0 is rare
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+        points[i].userData = reinterpret_cast<void*>(uintptr_t(i % 500 == 0 ? 0 : 1 + i % 7));
+    }
+
+    KDTree<2> tree(points);
+    tree.BuildCategoryMasks([](const point& p) { return uint64_t(1) << reinterpret_cast<uintptr_t>(p.userData); });
+
+    auto category = [](const node* n) { return reinterpret_cast<uintptr_t>(n->point.userData); };
+    auto evenIndex = [](const node* n) { return n->index % 2 == 0; };
+
+    int k = 5;
+    KDTree<2>::KnnResultSet set(k);
+
+    for (int q = 0; q < 20; ++q)
+    {
+        point target{ Prand(-10000, 10000), Prand(-10000, 10000) };
+
+        // Brute force for the rare category and even indices
+        std::vector<float> rare;
+        std::vector<float> even;
+        for (int i = 0; i < count; ++i)
+        {
+            float d = tree.dist2(target, points[i]);
+            if (i % 500 == 0 && i % 2 == 0)
+            {
+                rare.push_back(d);
+            }
+
+            if (i % 2 == 0)
+            {
+                even.push_back(d);
+            }
+        }
+
+        std::sort(rare.begin(), rare.end());
+        std::sort(even.begin(), even.end());
+
+        auto nn = tree.QueryNearestNeighbor(target, evenIndex);
+        REQUIRE_EQ(nn.distance2, even[0]);
+
+        tree.QueryKNearestNeighbors(target, set, [&](const node* n) { return category(n) == 0 && evenIndex(n); });
+        for (int i = 0; i < k; ++i)
+        {
+            REQUIRE_EQ(set[i].distance2, rare[i]);
+        }
+
+        // Subtrees without the rare category are pruned by the masks
+        nn = tree.QueryNearestNeighbor(target, 1, evenIndex);
+        REQUIRE_EQ(nn.distance2, rare[0]);
+
+        tree.QueryKNearestNeighbors(target, set, 1, evenIndex);
+        for (int i = 0; i < k; ++i)
+        {
+            REQUIRE_EQ(set[i].distance2, rare[i]);
+            REQUIRE_EQ(category(set[i].node), 0);
+        }
+    }
+
+    // No point passes the predicate
+    auto none = tree.QueryNearestNeighbor(points[0], [](const node* n) { return false; });
+    REQUIRE_EQ(none.node, nullptr);
+}
+
+TEST_CASE("Tree statistics")
+{
+    int count = 1000;
+
+    using point = KDTree<2>::Point;
+    using node = KDTree<2>::Node;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    KDTree<2> tree(points);
+    auto stats = tree.GetStats();
+
+    // Median splits produce a balanced tree
+    REQUIRE_EQ(stats.nodeCount, count);
+    REQUIRE_EQ(stats.height, 10);
+    REQUIRE_EQ(stats.depthHistogram.size(), 10);
+    REQUIRE_EQ(stats.depthHistogram[0], 1);
+    REQUIRE_EQ(stats.depthHistogram[8], 256);
+
+    size_t nodes = 0;
+    size_t leaves = 0;
+    for (int depth = 0; depth < stats.height; ++depth)
+    {
+        nodes += stats.depthHistogram[depth];
+        leaves += stats.leafDepthHistogram[depth];
+    }
+
+    REQUIRE_EQ(nodes, count);
+    REQUIRE_EQ(leaves, stats.leafCount);
+    REQUIRE_EQ(stats.leafDepthHistogram[9], stats.depthHistogram[9]);
+
+    REQUIRE_EQ(stats.memoryUsed, count * sizeof(node));
+    REQUIRE_EQ(stats.memoryReserved, stats.memoryUsed);
+
+    REQUIRE_GE(stats.averageAspectRatio, 1.0);
+    REQUIRE_LT(stats.averageAspectRatio, 10.0);
+
+    REQUIRE_GE(stats.buildSeconds, stats.partitionSeconds);
+    REQUIRE_GE(stats.partitionSeconds, 0.0);
+
+    std::cout << "\n----------------------\n" << std::endl;
+    std::cout << "Tree statistics" << std::endl;
+    std::cout << "Height\t\t: " << stats.height << std::endl;
+    std::cout << "Leaves\t\t: " << stats.leafCount << std::endl;
+    std::cout << "Memory used\t: " << stats.memoryUsed << " of " << stats.memoryReserved << " bytes" << std::endl;
+    std::cout << "Aspect ratio\t: " << stats.averageAspectRatio << std::endl;
+    std::cout << "Build\t\t: " << stats.buildSeconds * 1000 << "ms" << std::endl;
+}
+
+TEST_CASE("Node allocation")
+{
+    using point = KDTree<3>::Point;
+    using node = KDTree<3>::Node;
+
+    std::vector<point> points(1000);
+    for (point& p : points)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    // Nodes are allocated from the arena, exactly one per point
+    std::vector<std::byte> buffer(points.size() * sizeof(node) * 2);
+    std::pmr::monotonic_buffer_resource arena{ buffer.data(), buffer.size(), std::pmr::null_memory_resource() };
+
+    KDTree<3> tree(points, &arena);
+
+    auto nodes = tree.GetNodes();
+    REQUIRE_EQ(nodes.size(), points.size());
+    REQUIRE((std::byte*)nodes.data() >= buffer.data());
+    REQUIRE((std::byte*)(nodes.data() + nodes.size()) <= buffer.data() + buffer.size());
+    REQUIRE_EQ(tree.GetStats().memoryReserved, points.size() * sizeof(node));
+
+    // Rebuilding with the same number of points reuses the storage
+    tree.BuildTree(points);
+    REQUIRE_EQ(tree.GetNodes().data(), nodes.data());
+
+    point target{ 0, 0, 0 };
+    float bd = FLT_MAX;
+    for (const point& p : points)
+    {
+        bd = std::min(bd, tree.dist2(target, p));
+    }
+    REQUIRE_EQ(tree.QueryNearestNeighbor(target).distance2, bd);
+
+    // Trees of one and two points
+    KDTree<3> single(std::span{ points }.first(1));
+    REQUIRE_EQ(single.QueryNearestNeighbor(target).node->index, 0);
+
+    KDTree<3> pair(std::span{ points }.first(2));
+    REQUIRE_EQ(pair.GetNodes().size(), 2);
+}
+
+TEST_CASE("Huge page and NUMA allocation")
+{
+    int count = 100000;
+
+    using point = KDTree<3>::Point;
+
+    std::vector<point> points(count);
+    for (point& p : points)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    point target{ Prand(-10000, 10000), Prand(-10000, 10000), Prand(-10000, 10000) };
+
+    float bd = FLT_MAX;
+    for (const point& p : points)
+    {
+        bd = std::min(bd, KDTree<3>::dist2(target, p));
+    }
+
+    // Explicit huge pages fall back to transparent ones if none are reserved
+    for (HugePages hugePages : { HugePages::None, HugePages::Transparent, HugePages::Size2MB })
+    {
+        for (NumaPolicy policy : { NumaPolicy::Default, NumaPolicy::Interleave, NumaPolicy::Bind })
+        {
+            PageResource resource{ PageOptions{ hugePages, policy, GetNumaNodes()[0] } };
+
+            KDTree<3> tree(points, &resource);
+            REQUIRE_EQ(tree.QueryNearestNeighbor(target).distance2, bd);
+
+            // Rebuilding releases the previous mapping
+            tree.BuildTree(std::span{ points }.first(count / 2));
+            REQUIRE_EQ(tree.GetNodes().size(), count / 2);
+        }
+    }
+
+    NumaReplicatedKDTree<3> replicated(points);
+    REQUIRE_EQ(replicated.GetReplicaCount(), (int)GetNumaNodes().size());
+    REQUIRE_EQ(replicated.Local().QueryNearestNeighbor(target).distance2, bd);
+
+    for (int i = 0; i < replicated.GetReplicaCount(); ++i)
+    {
+        REQUIRE_EQ(replicated.GetReplica(i).QueryNearestNeighbor(target).distance2, bd);
+    }
+}
+
+TEST_CASE("Batch queries")
+{
+    int count = 100000;
+    int queries = 1000;
+    int k = 10;
+
+    using point = KDTree<3>::Point;
+    using result = KDTree<3>::QueryResult;
+
+    std::vector<point> points(count);
+    for (point& p : points)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    std::vector<point> targets(queries);
+    for (point& p : targets)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    KDTree<3> tree(points);
+
+    for (int groupSize : { 1, 8, 32 })
+    {
+        std::vector<result> nn(queries);
+        tree.QueryNearestNeighbors(targets, nn, groupSize);
+
+        std::vector<result> knn(queries * k);
+        tree.QueryKNearestNeighbors(targets, k, knn, groupSize);
+
+        KDTree<3>::KnnResultSet set{ k };
+        for (int i = 0; i < queries; ++i)
+        {
+            REQUIRE_EQ(nn[i].distance2, tree.QueryNearestNeighbor(targets[i]).distance2);
+
+            tree.QueryKNearestNeighbors(targets[i], set);
+            for (int j = 0; j < k; ++j)
+            {
+                REQUIRE_EQ(knn[i * k + j].distance2, set[j].distance2);
+            }
+        }
+    }
+
+    // Missing neighbors of a tree smaller than k
+    KDTree<3> small(std::span{ points }.first(5));
+    std::vector<result> knn(2 * k);
+    small.QueryKNearestNeighbors(std::span{ targets }.first(2), k, knn);
+
+    REQUIRE_NE(knn[4].node, nullptr);
+    REQUIRE_EQ(knn[5].node, nullptr);
+    REQUIRE_EQ(knn[k + 9].node, nullptr);
+}
+
+TEST_CASE("Packet queries")
+{
+    int count = 100000;
+    int queries = 1000;
+    int k = 10;
+
+    using point = KDTree<3>::Point;
+    using result = KDTree<3>::QueryResult;
+
+    std::vector<point> points(count);
+    for (point& p : points)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    // The first half are coherent groups of 16 targets around the first one of the group, the rest make packets diverge
+    std::vector<point> targets(queries);
+    for (int i = 0; i < queries; ++i)
+    {
+        targets[i] = point{ Prand(-10000, 10000), Prand(-10000, 10000), Prand(-10000, 10000) };
+        if (i < queries / 2 && i % 16 != 0)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                targets[i][j] = targets[i - i % 16][j] + Prand(-100, 100);
+            }
+        }
+    }
+
+    KDTree<3> tree(points);
+
+    for (int packetSize : { 1, 7, 16, KDTree<3>::maxPacketSize })
+    {
+        std::vector<result> nn(queries);
+        tree.QueryNearestNeighborsPacket(targets, nn, packetSize);
+
+        std::vector<result> knn(queries * k);
+        tree.QueryKNearestNeighborsPacket(targets, k, knn, packetSize);
+
+        KDTree<3>::KnnResultSet set{ k };
+        for (int i = 0; i < queries; ++i)
+        {
+            REQUIRE_EQ(nn[i].distance2, tree.QueryNearestNeighbor(targets[i]).distance2);
+
+            tree.QueryKNearestNeighbors(targets[i], set);
+            for (int j = 0; j < k; ++j)
+            {
+                REQUIRE_EQ(knn[i * k + j].distance2, set[j].distance2);
+            }
+        }
+    }
+
+    // Missing neighbors of a tree smaller than k
+    KDTree<3> small(std::span{ points }.first(5));
+    std::vector<result> knn(2 * k);
+    small.QueryKNearestNeighborsPacket(std::span{ targets }.first(2), k, knn);
+
+    REQUIRE_NE(knn[4].node, nullptr);
+    REQUIRE_EQ(knn[5].node, nullptr);
+    REQUIRE_EQ(knn[k + 9].node, nullptr);
+}
+
+TEST_CASE("Batch query order")
+{
+    // Radix sort is stable and matches a comparison sort, with ranges large enough for several threads
+    std::mt19937_64 rng{ 1 };
+    std::vector<std::pair<uint64_t, int>> items(300000);
+    for (int i = 0; i < (int)items.size(); ++i)
+    {
+        items[i] = { (rng() % 1000) << 20 | 0xff, i };
+    }
+
+    std::vector<std::pair<uint64_t, int>> sorted = items;
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.first < b.first; });
+
+    RadixSort(items, 4);
+    REQUIRE(items == sorted);
+
+    // Both curves visit every cell once, consecutive cells of the Hilbert curve are adjacent
+    for (int dimensions : { 2, 3 })
+    {
+        int bits = 3;
+        int cellCount = 1 << (dimensions * bits);
+
+        std::vector<std::vector<uint32_t>> morton(cellCount), hilbert(cellCount);
+        for (int cell = 0; cell < cellCount; ++cell)
+        {
+            uint32_t coords[3] = { uint32_t(cell & 7), uint32_t(cell >> 3 & 7), uint32_t(cell >> 6 & 7) };
+            std::vector<uint32_t> c(coords, coords + dimensions);
+
+            uint64_t m = MortonCode(coords, dimensions, bits);
+            uint64_t h = HilbertCode(coords, dimensions, bits);
+            REQUIRE(m < (uint64_t)cellCount);
+            REQUIRE(h < (uint64_t)cellCount);
+            REQUIRE(morton[m].empty());
+            REQUIRE(hilbert[h].empty());
+
+            morton[m] = c;
+            hilbert[h] = c;
+        }
+
+        for (int i = 1; i < cellCount; ++i)
+        {
+            int distance = 0;
+            for (int j = 0; j < dimensions; ++j)
+            {
+                distance += std::abs(int(hilbert[i][j]) - int(hilbert[i - 1][j]));
+            }
+            REQUIRE_EQ(distance, 1);
+        }
+    }
+
+    // Ordered queries write the same results in the order of the targets
+    int count = 100000;
+    int queries = 5000;
+    int k = 5;
+
+    using point = KDTree<3>::Point;
+    using result = KDTree<3>::QueryResult;
+
+    std::vector<point> points(count);
+    for (point& p : points)
+    {
+        p = point{ Prand(-10000, 10000), Prand(-10000, 10000), Prand(-10000, 10000) };
+    }
+
+    // Some targets lie outside of the bounding box of the tree
+    std::vector<point> targets(queries);
+    for (point& p : targets)
+    {
+        p = point{ Prand(-12000, 12000), Prand(-12000, 12000), Prand(-12000, 12000) };
+    }
+
+    KDTree<3> tree(points);
+
+    std::vector<result> expected(queries * k);
+    tree.QueryKNearestNeighbors(targets, k, expected);
+
+    for (BatchOrder order : { BatchOrder::Morton, BatchOrder::Hilbert })
+    {
+        std::vector<result> nn(queries);
+        tree.QueryNearestNeighbors(targets, nn, 0, order);
+
+        std::vector<result> knn(queries * k);
+        tree.QueryKNearestNeighbors(targets, k, knn, 0, order);
+
+        std::vector<result> packet(queries * k);
+        tree.QueryKNearestNeighborsPacket(targets, k, packet, 16, order);
+
+        for (int i = 0; i < queries; ++i)
+        {
+            REQUIRE_EQ(nn[i].distance2, expected[i * k].distance2);
+            for (int j = 0; j < k; ++j)
+            {
+                REQUIRE_EQ(knn[i * k + j].distance2, expected[i * k + j].distance2);
+                REQUIRE_EQ(packet[i * k + j].distance2, expected[i * k + j].distance2);
+            }
+        }
+    }
+
+    // With two axes cells have 32 bits, targets on and past the upper corner fall into the last cell
+    using point2 = KDTree<2>::Point;
+
+    std::vector<point2> points2(1000);
+    for (point2& p : points2)
+    {
+        p = point2{ Prand(0, 1000), Prand(0, 1000) };
+    }
+    points2.push_back(point2{ 0, 0 });
+    points2.push_back(point2{ 1000, 1000 });
+
+    KDTree<2> tree2(points2);
+
+    std::vector<point2> corners = { { 1000, 1000 }, { 1000, 500 }, { 500, 1000 }, { 2000, 2000 }, { 1e6f, 1e6f }, { -5, 1000 } };
+    for (int i = 0; i < 100; ++i)
+    {
+        corners.push_back(point2{ Prand(0, 1000), Prand(0, 1000) });
+    }
+
+    for (BatchOrder order : { BatchOrder::Morton, BatchOrder::Hilbert })
+    {
+        std::vector<KDTree<2>::QueryResult> nn(corners.size());
+        tree2.QueryNearestNeighbors(corners, nn, 0, order);
+
+        for (size_t i = 0; i < corners.size(); ++i)
+        {
+            REQUIRE_EQ(nn[i].distance2, tree2.QueryNearestNeighbor(corners[i]).distance2);
+        }
+    }
+}
+
+TEST_CASE("Warm-started queries")
+{
+    int count = 20000;
+    int frames = 20;
+
+    using point = KDTree<3>::Point;
+
+    // Integer coordinates make for duplicates and ties at the bound
+    std::vector<point> points(count);
+    for (point& p : points)
+    {
+        p = point{ std::round(Prand(0, 30)), std::round(Prand(0, 30)), std::round(Prand(0, 30)) };
+    }
+
+    KDTree<3> tree(points);
+
+    for (int k : { 1, 8, 50 })
+    {
+        point target{ Prand(0, 30), Prand(0, 30), Prand(0, 30) };
+
+        KDTree<3>::QueryResult nn = tree.QueryNearestNeighbor(target);
+        KDTree<3>::KnnResultSet warm{ k };
+        KDTree<3>::KnnResultSet cold{ k };
+        tree.QueryKNearestNeighbors(target, warm);
+
+        // The target moves a bit every frame, the previous results are the ones of the same set
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                target[j] += frame % 5 == 0 ? 0.0f : Prand(-0.5f, 0.5f);
+            }
+
+            nn = tree.QueryNearestNeighbor(target, nn.node);
+            REQUIRE_EQ(nn.distance2, tree.QueryNearestNeighbor(target).distance2);
+
+            tree.QueryKNearestNeighbors(target, warm, warm.Results());
+            tree.QueryKNearestNeighbors(target, cold);
+
+            REQUIRE_EQ(warm.Size(), k);
+            for (int i = 0; i < k; ++i)
+            {
+                REQUIRE_EQ(warm[i].distance2, cold[i].distance2);
+            }
+        }
+    }
+
+    // Fewer previous results than k don't bound the search
+    KDTree<3> small(std::span{ points }.first(5));
+    KDTree<3>::KnnResultSet set{ 8 };
+    small.QueryKNearestNeighbors(points[0], set);
+    small.QueryKNearestNeighbors(points[1], set, set.Results());
+
+    REQUIRE_EQ(set.Size(), 5);
+    REQUIRE_EQ(set[0].distance2, 0);
+}
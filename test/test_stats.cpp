@@ -0,0 +1,82 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+// Statistics are compiled in for this target only, the main tests cover the default build without them
+#define KD_TREE_STATS 1
+#include "kd_tree/kd_tree.h"
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+inline std::minstd_rand prng;
+
+inline float Prand()
+{
+    return float(prng()) / std::minstd_rand::max();
+}
+
+inline float Prand(float min, float max)
+{
+    return min + (max - min) * Prand();
+}
+
+TEST_CASE("Query statistics")
+{
+    int count = 100000;
+
+    using point = KDTree<2>::Point;
+
+    std::vector<point> points(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        points[i][0] = Prand(-10000, 10000);
+        points[i][1] = Prand(-10000, 10000);
+    }
+
+    KDTree<2> tree(points);
+
+    point target{ Prand(-10000, 10000), Prand(-10000, 10000) };
+
+    tree.QueryNearestNeighbor(target);
+    QueryStats nn = GetQueryStats();
+
+    REQUIRE_EQ(nn.queries, 1);
+    REQUIRE_EQ(nn.distanceEvaluations, nn.nodesVisited);
+    REQUIRE_GT(nn.nodesVisited, 0);
+    REQUIRE_GT(nn.leavesScanned, 0);
+    REQUIRE_GT(nn.branchesPruned, 0);
+    REQUIRE_LT(nn.nodesVisited, uint64_t(count / 100));
+    REQUIRE_LE(nn.maxStackDepth, 18);
+
+    // A larger k needs more nodes
+    KDTree<2>::KnnResultSet set{ 64 };
+    tree.QueryKNearestNeighbors(target, set);
+    QueryStats knn = GetQueryStats();
+
+    REQUIRE_EQ(knn.queries, 1);
+    REQUIRE_GE(knn.nodesVisited, nn.nodesVisited);
+    REQUIRE_GT(knn.backtracks, 0);
+
+    // Every point of a fully contained box is visited without distance evaluations
+    std::vector<const KDTree<2>::Node*> found;
+    tree.QueryBox(point{ -10000, -10000 }, point{ 10000, 10000 }, std::back_inserter(found));
+    REQUIRE_EQ(GetQueryStats().nodesVisited, uint64_t(count));
+    REQUIRE_EQ(GetQueryStats().distanceEvaluations, 0);
+
+    QueryStats total;
+    total += nn;
+    total += knn;
+
+    REQUIRE_EQ(total.queries, 2);
+    REQUIRE_EQ(total.nodesVisited, nn.nodesVisited + knn.nodesVisited);
+    REQUIRE_EQ(total.maxStackDepth, std::max(nn.maxStackDepth, knn.maxStackDepth));
+
+    std::cout << "\n----------------------\n" << std::endl;
+    std::cout << "Query statistics" << std::endl;
+    std::cout << "NN nodes visited\t: " << nn.nodesVisited << std::endl;
+    std::cout << "NN branches pruned\t: " << nn.branchesPruned << std::endl;
+    std::cout << "64-NN nodes visited\t: " << knn.nodesVisited << std::endl;
+    std::cout << "64-NN backtracks\t: " << knn.backtracks << std::endl;
+}